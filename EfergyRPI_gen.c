@@ -0,0 +1,243 @@
+/*---------------------------------------------------------------------
+
+EFERGY SIGNAL GENERATOR
+
+Writes what rtl_fm (or rtl_sdr with -q) would deliver while Efergy transmitters send
+their readings, so EfergyRPI_log and EfergyRPI_001 can be tried out, checked and timed
+without a radio.  See efergy_gen.h for what the signal looks like.
+
+Compile:
+
+gcc -O2 -o EfergyRPI_gen EfergyRPI_gen.c
+
+Examples:
+
+./EfergyRPI_gen -n 100 -p 150:3000 -t truth.csv > clean.raw
+./EfergyRPI_log -t -r clean.raw | grep , | cut -d, -f3- | diff - truth.csv
+	(every reading should come back)
+
+./EfergyRPI_gen -n 500 -N 2500 -j 5 -b -3000 -f 50 -i -s 7 > rough.raw
+	(noise, jitter, DC offset and drift, upside down)
+
+./EfergyRPI_gen -d elite -m 0912a4b0 -m 0912a4b8 -q 288000 > two.cu8
+./EfergyRPI_log -i 288000 -d elite -t -r two.cu8
+	(two Elite 3.0 TPMs taking turns, as rtl_sdr IQ)
+
+--------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "efergy_gen.h"
+#include "efergy_meter.h"
+
+#define GEN_MAX_TX		16	/* Transmitters taking turns */
+
+struct transmitter {
+	const struct device_profile *profile;
+	uint32_t id;
+};
+
+void usage(const char *name)
+{
+	printf("\nUsage: %s [options] > capture.raw\n", name);
+	printf("\nOptions:\n");
+	printf("       -n <frames>    - Number of frames (default 100)\n");
+	printf("       -d <profile>   - Profile of the transmitters given after it, e2 (default), elite or one from -c\n");
+	printf("       -c <file>      - Load device profiles from a config file\n");
+	printf("       -m <id>        - Add a transmitter with this (hex) id.  Repeat for more, they take turns\n");
+	printf("       -p <w>[:<max>] - Reading in watts, or a random one between the two (default 100:5000)\n");
+	printf("       -r <rate>      - Sample rate, rtl_fm's -r (default %d)\n", PROFILE_RATE);
+	printf("       -g <seconds>   - Noise ahead of every frame (default 0.05)\n");
+	printf("       -N <noise>     - Noise during frames, standard deviation in sample units (default 0)\n");
+	printf("       -G <noise>     - Noise between frames (default %d)\n", GEN_GAP_NOISE);
+	printf("       -l <level>     - Distance of the FSK levels from the center (default %d)\n", GEN_LEVEL);
+	printf("       -b <offset>    - DC offset of the center\n");
+	printf("       -f <drift>     - Change of the DC offset per second\n");
+	printf("       -j <us>        - Jitter of the pulse lengths, standard deviation in microseconds\n");
+	printf("       -i             - Signal upside down\n");
+	printf("       -s <seed>      - Seed of the random numbers (default 1)\n");
+	printf("       -q [rate]      - Write cu8 IQ at this rate (default %d) instead of rtl_fm samples\n", FM_DEFAULT_IQ_RATE);
+	printf("       -t <file>      - Write the readings the frames carry to file, as id,watts\n");
+	printf("       -o <file>      - Write the samples to file instead of stdout\n");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+struct profile_table profiles;
+struct transmitter tx[GEN_MAX_TX];
+char *tx_profile[GEN_MAX_TX];
+int ntx = 0;
+char *profile_name = "e2";
+char *config_name = NULL;
+struct gen_params params;
+struct gen gen;
+struct gen_iq iq;
+struct gen_buf buf = { NULL, 0, 0 };
+unsigned char bytes[PROFILE_MAX_BYTES];
+unsigned char *iqbuf = NULL;
+size_t iqmax = 0;
+size_t n;
+long frames = 100;
+long iq_rate = 0;
+double min_watts = 100, max_watts = 5000;
+double watts;
+char *truthname = NULL;
+char *outname = NULL;
+char *end;
+FILE *truth = NULL;
+FILE *out = stdout;
+uint32_t id;
+int argi;
+long f;
+int i;
+
+	gen_params_init(&params);
+	iq.decimation = 0;
+
+	for (argi = 1; argi < argc; argi++) {
+	  if (strncmp(argv[argi], "-h", 2)==0) {
+	    usage(argv[0]);
+	  } else if ((strcmp(argv[argi], "-n")==0) && (argi+1 < argc)) {
+	    frames = strtol(argv[++argi], NULL, 0);
+	  } else if ((strcmp(argv[argi], "-d")==0) && (argi+1 < argc)) {
+	    profile_name = argv[++argi];
+	  } else if ((strcmp(argv[argi], "-c")==0) && (argi+1 < argc)) {
+	    config_name = argv[++argi];
+	  } else if ((strcmp(argv[argi], "-m")==0) && (argi+1 < argc)) {
+	    if (meter_parse_id(argv[++argi], &id) < 0 || ntx == GEN_MAX_TX) {
+	      fprintf(stderr, "Bad transmitter id %s, or more than %d of them\n", argv[argi], GEN_MAX_TX);
+	      exit(EXIT_FAILURE);
+	    }
+	    tx[ntx].id = id;
+	    tx_profile[ntx++] = profile_name;
+	  } else if ((strcmp(argv[argi], "-p")==0) && (argi+1 < argc)) {
+	    min_watts = max_watts = strtod(argv[++argi], &end);
+	    if (*end == ':')
+	      max_watts = strtod(end + 1, &end);
+	    if (*end != '\0' || min_watts < 0 || max_watts < min_watts) {
+	      fprintf(stderr, "Bad reading %s\n", argv[argi]);
+	      exit(EXIT_FAILURE);
+	    }
+	  } else if ((strcmp(argv[argi], "-r")==0) && (argi+1 < argc)) {
+	    params.rate = strtol(argv[++argi], NULL, 0);
+	  } else if ((strcmp(argv[argi], "-g")==0) && (argi+1 < argc)) {
+	    params.gap = strtod(argv[++argi], NULL);
+	  } else if ((strcmp(argv[argi], "-N")==0) && (argi+1 < argc)) {
+	    params.noise = strtod(argv[++argi], NULL);
+	  } else if ((strcmp(argv[argi], "-G")==0) && (argi+1 < argc)) {
+	    params.gap_noise = strtod(argv[++argi], NULL);
+	  } else if ((strcmp(argv[argi], "-l")==0) && (argi+1 < argc)) {
+	    params.level = strtod(argv[++argi], NULL);
+	  } else if ((strcmp(argv[argi], "-b")==0) && (argi+1 < argc)) {
+	    params.dc = strtod(argv[++argi], NULL);
+	  } else if ((strcmp(argv[argi], "-f")==0) && (argi+1 < argc)) {
+	    params.drift = strtod(argv[++argi], NULL);
+	  } else if ((strcmp(argv[argi], "-j")==0) && (argi+1 < argc)) {
+	    params.jitter = strtod(argv[++argi], NULL);
+	  } else if (strcmp(argv[argi], "-i")==0) {
+	    params.inverted = 1;
+	  } else if ((strcmp(argv[argi], "-s")==0) && (argi+1 < argc)) {
+	    params.seed = strtoull(argv[++argi], NULL, 0);
+	  } else if (strcmp(argv[argi], "-q")==0) {
+	    iq_rate = FM_DEFAULT_IQ_RATE;
+	    if ((argi+1 < argc) && (argv[argi+1][0] >= '0') && (argv[argi+1][0] <= '9'))
+	      iq_rate = strtol(argv[++argi], NULL, 0);
+	  } else if ((strcmp(argv[argi], "-t")==0) && (argi+1 < argc)) {
+	    truthname = argv[++argi];
+	  } else if ((strcmp(argv[argi], "-o")==0) && (argi+1 < argc)) {
+	    outname = argv[++argi];
+	  } else {
+	    fprintf(stderr, "Unknown option %s, -h for help\n", argv[argi]);
+	    exit(EXIT_FAILURE);
+	  }
+	}
+
+	if (params.rate <= 0) {
+	  fprintf(stderr, "Bad sample rate %ld\n", params.rate);
+	  exit(EXIT_FAILURE);
+	}
+	profile_table_init(&profiles);
+	if ((config_name != NULL) && (profile_load(&profiles, config_name) < 0))
+	  exit(EXIT_FAILURE);
+	if (ntx == 0) {
+	  tx[0].id = 0x0912a4b0;
+	  tx_profile[ntx++] = profile_name;
+	}
+	for (i = 0; i < ntx; i++) {
+	  tx[i].profile = profile_find(&profiles, tx_profile[i]);
+	  if (tx[i].profile == NULL) {
+	    fprintf(stderr, "Unknown device profile %s\n", tx_profile[i]);
+	    exit(EXIT_FAILURE);
+	  }
+	}
+	if (iq_rate != 0 && gen_iq_init(&iq, iq_rate, params.rate) < 0) {
+	  fprintf(stderr, "IQ sample rate must be a multiple of %ld\n", params.rate);
+	  exit(EXIT_FAILURE);
+	}
+
+	if (outname != NULL) {
+	  out = fopen(outname, "wb");
+	  if (out == NULL) {
+	    perror(outname);
+	    exit(EXIT_FAILURE);
+	  }
+	}
+	if (truthname != NULL) {
+	  truth = fopen(truthname, "w");
+	  if (truth == NULL) {
+	    perror(truthname);
+	    exit(EXIT_FAILURE);
+	  }
+	}
+
+	gen_init(&gen, &params);
+	for (f = 0; f < frames; f++) {
+	  i = f % ntx;
+	  watts = min_watts + (max_watts - min_watts) * gen_uniform(&gen);
+	  watts = gen_frame_bytes(tx[i].profile, tx[i].id, watts, bytes);
+	  if (truth != NULL)
+	    fprintf(truth, "%08x,%f\n", (unsigned int) tx[i].id, watts);
+
+	  buf.n = 0;
+	  if (gen_frame(&gen, &buf, bytes, tx[i].profile->bytecount) < 0 ||
+	      (f == frames - 1 && gen_gap(&gen, &buf, params.gap) < 0)) {	/* noise after the last one too */
+	    perror("Failed to allocate sample buffer");
+	    exit(EXIT_FAILURE);
+	  }
+
+	  if (iq_rate == 0) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	    for (n = 0; n < buf.n; n++)
+	      buf.s[n] = (int16_t) (((uint16_t) buf.s[n] >> 8) | ((uint16_t) buf.s[n] << 8));
+#endif
+	    n = fwrite(buf.s, sizeof(int16_t), buf.n, out);
+	  } else {
+	    if (iqmax < 2 * iq.decimation * buf.n) {
+	      iqmax = 2 * iq.decimation * buf.max;
+	      free(iqbuf);
+	      iqbuf = (unsigned char *) malloc(iqmax);
+	      if (iqbuf == NULL) {
+		perror("Failed to allocate IQ buffer");
+		exit(EXIT_FAILURE);
+	      }
+	    }
+	    n = gen_iq_process(&iq, buf.s, buf.n, iqbuf);
+	    n = (fwrite(iqbuf, 1, n, out) == n) ? buf.n : 0;
+	  }
+	  if (n != buf.n) {
+	    perror("Failed to write samples");
+	    exit(EXIT_FAILURE);
+	  }
+	}
+
+	if (fclose(out) != 0 || (truth != NULL && fclose(truth) != 0)) {
+	  perror("Failed to write samples");
+	  exit(EXIT_FAILURE);
+	}
+	free(buf.s);
+	free(iqbuf);
+	return 0;
+}
@@ -84,36 +84,226 @@ rtl_fm -f 433550000 -s 200000 -r 96000 -g 19.7 2>/dev/null | ./EfergyRPI_001
 //	*Notice the "-A fast" option on  rtl_fm.  This cut Raspberry Pi cpu load from 50% to 25% and decode still worked fine.
 //	Also, with an R820T USB dongle, leaving  rtl_fm gain in 'auto' mode  produced the best results.
 //
+// 16/10/2026 - Samples are now read from stdin in 64KiB blocks (see efergy_reader.h) instead of two fgetc() calls
+//	per sample.  This also removes the unspecified evaluation order of the two fgetc() calls.
+//
+// 16/10/2026 - Added -i option to take raw cu8 IQ samples straight from rtl_sdr and FM demodulate them in process
+//	(see efergy_fm.h), so rtl_fm is no longer needed in the pipeline.  -f reads from a file instead of stdin,
+//	which is handy for recorded .cu8 captures.
+//
+//	rtl_sdr -f 433.51e6 -s 288000 -g 19.7 - 2>/dev/null | ./EfergyRPI_log -i 288000 efergy.csv
+//	./EfergyRPI_log -i 288000 -a 2 -f capture.cu8
+//
+// 16/10/2026 - The decode loop and the analysis pulse stream now work on runs of samples above/below center
+//	produced by efergy_slicer.h, which compares 8 or 16 samples at a time with SSE2/AVX2 or NEON.  Build with
+//	-march=native (or -msse2/-mavx2/-mfpu=neon) to get the vector path, -DSLICER_SCALAR for plain C.
+//
+//	gcc -O3 -march=native -o EfergyRPI_log EfergyRPI_log.c -lm
+//
+// 16/10/2026 - Readings are handed to a writer thread through a lock-free ring (see efergy_writer.h), so a slow
+//	SD card write no longer stalls the decode loop and backs up rtl_fm.  The log file is still written every
+//	SAMPLES_TO_FLUSH readings.  Link with -lpthread now:
+//
+//	gcc -O3 -march=native -o EfergyRPI_log EfergyRPI_log.c -lm -lpthread
+//
+// 16/10/2026 - Added -b <file> to also log readings to a compact binary file (see efergy_binlog.h) with fixed 16 byte
+//	records and CRC checked blocks, and -p <file> to print such a file back as CSV.
+//
+//	rtl_fm -f 433.51e6 -s 200000 -r 96000 2>/dev/null | ./EfergyRPI_log -b efergy.bin efergy.csv
+//	./EfergyRPI_log -p efergy.bin
+//
+// 16/10/2026 - Added -r <file> to replay recorded rtl_fm captures (or cu8 captures with -i) at full speed.  The files are
+//	mmap()ed and run through the normal decode loop, then samples/sec and frames decoded are reported on stderr.
+//	Handy for checking threshold changes against old recordings.
+//
+//	./EfergyRPI_log -r monday.raw -r tuesday.raw > readings.txt
+//
+// 16/10/2026 - The decode state moved out of main() into struct decoder.  Added -j [threads] to decode a corpus of
+//	-r captures on all cores.  Long captures are cut ahead of preambles into chunks with their own decoder, the
+//	chunks are spread over a work stealing thread pool (see efergy_pool.h) and the readings are merged in
+//	timestamp order.  A capture is taken to end at its modification time.
+//
+//	./EfergyRPI_log -j 8 -r site1/*.raw ... > readings.txt
+//
+// 16/10/2026 - The MINLOWBIT/MINHIGHBIT/VOLTAGE #define blocks are replaced by device profiles picked at runtime with
+//	-d (e2 or elite built in), and more can be loaded from a config file with -c.  See efergy_profile.h for the
+//	file format.  The decode loop is compiled once per built in profile with constant thresholds.
+//
+//	rtl_fm -f 433.51e6 -s 200000 -r 96000 2>/dev/null | ./EfergyRPI_log -d elite efergy.csv
+//	rtl_fm -f 433.51e6 -s 200000 -r 96000 2>/dev/null | ./EfergyRPI_log -c /etc/efergy.conf -d garage efergy.csv
+//
+// 16/10/2026 - -d can be given more than once to decode transmitters of different profiles (e.g. an E2 Classic and an
+//	Elite 3.0 TPM) from the same rtl_fm stream.  The wave center and the pulse runs are computed once and every
+//	profile runs its own frame state on them.  A burst is only reported as a checksum error, and the center
+//	resampled, if no profile decoded it.  A frame of one profile can pass the 8 bit checksum of another, so with
+//	several profiles a good frame also has to have its bits on a steady clock and nothing right after it.
+//
+//	rtl_fm -f 433.51e6 -s 200000 -r 96000 2>/dev/null | ./EfergyRPI_log -d e2 -d elite efergy.csv
+//
+// 16/10/2026 - Readings are now told apart by the transmitter id in frame bytes 0-3 (see efergy_meter.h).  -t adds
+//	the id to every line, -m <id> keeps only the readings of the given transmitters (frames of the neighbours'
+//	meters are dropped before they are formatted) and -s writes every transmitter to a log file of its own.
+//	Replays end with a summary of the transmitters heard.
+//
+//	rtl_fm -f 433.51e6 -s 200000 -r 96000 2>/dev/null | ./EfergyRPI_log -m 0912a4b0 -m 0912a4b8 -s efergy.csv
+//		(logs to efergy-0912a4b0.csv and efergy-0912a4b8.csv)
+//
+// 16/10/2026 - Timestamps no longer cost a time(), localtime() and strftime() per reading.  The date part is formatted
+//	once a day and the time of day is patched in place (see efergy_stamp.h).  Readings are timed off the monotonic
+//	clock, resynced to the wall clock every minute, and -u [digits] adds a fraction of a second to the time.
+//
+// 16/10/2026 - The pow() per frame is replaced by a table of the 256 power of two scale factors (see efergy_watts.h),
+//	with bit for bit the same results, so -lm is no longer needed for either program.  -w logs the readings as
+//	integer milliwatts worked out without floating point, for soft-float ARM boards.
+//
+//	gcc -O3 -march=native -o EfergyRPI_log EfergyRPI_log.c -lpthread
+//
+// 16/10/2026 - Added -e to track the wave center on every preamble instead of resampling CENTERSAMP samples after a
+//	checksum error.  The low and high levels around each preamble are measured and the center follows them with a
+//	moving average, so frequency drift of a warming dongle is followed without dropping frames to resample.
+//	A preamble only counts once the frame after it has passed the checksum (and the guard), so noise doesn't move
+//	the center, and the center is still resampled until the first good frame or after a minute without one.
+//
+// 16/10/2026 - Added -q, a squelch that only decodes around bursts.  Every 512 samples are checked for the steady levels
+//	of FSK (small sample to sample changes next to the distance from center); pieces of plain noise are skipped
+//	without slicing them.  Replays report the share of samples that was decoded.
+//
+// 16/10/2026 - Added -x to find preambles with a correlator (see efergy_preamble.h) that matches the samples against
+//	the low-then-high shape of a preamble instead of counting one unbroken run above center, so a noise sample in
+//	the middle of the preamble no longer loses the frame.  Each hit restarts the frames at the pulse it ends in.
+//	Replays report the preambles found and their average score.
+//
+// 16/10/2026 - The decode loop now follows both polarities in one pass.  At some tuning offsets rtl_fm hands over the
+//	signal upside down, which analysis mode could already decode but the logger couldn't, so it silently logged
+//	nothing.  Every profile has a second frame state that keys off the pulses below center; whichever passes its
+//	checksum, with its bits on a steady clock, is logged.  The garbage read from the other polarity passes the 8 bit
+//	sum now and then, so the checksum alone isn't enough here.  -n goes back to positive pulses only.
+//
+// 16/10/2026 - Added -k to repair frames that miss their checksum by one bit.  Many failures are a single pulse right at
+//	MINHIGHBIT, so the decoder keeps how far each pulse was from the threshold and, on a checksum error, tries
+//	flipping the bits one sample from the threshold one at a time.  A frame is only kept if exactly one flip makes
+//	the checksum match, it has no more than four such bits, and its bits are on a steady clock (the guard, even with
+//	-n).  A repair counts against the wave center like a failure does.  Repaired readings end in ",corrected" (and
+//	are flagged in the binary log).
+//
+// 16/10/2026 - Added -l <file> to learn MINLOWBIT/MINHIGHBIT from the signal.  The pulses of every good frame are sorted
+//	into short and long ones and MINHIGHBIT is put halfway between the two (see efergy_adapt.h), MINLOWBIT and the
+//	preamble length are scaled along with the short pulses, so pulses stretched by the sample rate error of a dongle
+//	still decode.  What was learned is kept in the file for the next start.  Only frames that pass the checksum and
+//	the guard are learned from (the guard is on for -l even with a single profile), never failed or repaired ones,
+//	and the file is saved on the log writer thread so the decode loop doesn't wait for it.
+//
+//	rtl_fm -f 433.51e6 -s 200000 -r 96000 2>/dev/null | ./EfergyRPI_log -l /var/lib/efergy/thresholds efergy.csv
+//
+// 16/10/2026 - Added -R <rate> for rtl_fm running at another -r than 96000.  The thresholds of the profiles are sample
+//	counts tuned at 96000, so they are converted to the same lengths of time at the given rate (see profile_at_rate()
+//	in efergy_profile.h), and so are the analysis mode preamble and frame lengths.  At 48000 or 32000 a Pi Zero has
+//	half or a third of the samples to move through the pipe and decode.  -D <rate> averages the input down to a lower
+//	rate first, to see what a lower rate would decode on captures recorded at 96000; ratebench.sh runs a capture
+//	through the usual rates.  Learned thresholds (-l) are in samples, keep a file per rate.
+//
+//	rtl_fm -f 433.51e6 -s 200000 -r 48000 2>/dev/null | ./EfergyRPI_log -R 48000 efergy.csv
+//	./ratebench.sh monday.raw
+//
+// 16/10/2026 - Added -B [seconds] to benchmark the decoder.  The slicer, the frame state machines, calculate_watts(), the
+//	analysis scan and the whole pipeline are timed one by one on fixed made up signals (quiet, dense, inverted and
+//	noisy, see efergy_bench.h) and printed as CSV: ns per sample and per frame, frames/sec, how many times real time
+//	and, where perf_event_open(2) is allowed, instructions per sample and per frame.  Decode options given with it
+//	apply, so e.g. -B -x shows what the correlator costs.
+//
+//	./EfergyRPI_log -B > before.csv
+//	./EfergyRPI_log -R 48000 -B 2 > at48k.csv
+//
+// 16/10/2026 - The decoder (struct decoder and its frame states, the decode loops, squelch, correlator, repair and
+//	learning) moved into efergy_decoder.h.  It keeps no globals: samples are pushed in with decoder_process() and
+//	frames come back through a callback, so it can be embedded and run more than once per process.  This program
+//	and EfergyRPI_001 are now front-ends on it.
+//
+// 16/10/2026 - EfergyRPI_001 is now this program built with -DEFERGY_LEGACY_001 (EfergyRPI_001.c includes this file),
+//	so there is one decoder to fix and speed up and both give the same readings; the old copy summed the checksum
+//	and the ADC value in signed char.  It keeps its defaults: pulses above center only, no checksum error lines.
+//	Added -o to choose where the readings go at startup, any of stdout, csv:<file>, bin:<file> and udp:<host>:<port>
+//	(a datagram per line, e.g. for a collector daemon).  Without -o it is stdout plus <filename> and -b as before.
+//	There is one output of each kind: csv: and <filename>, or bin: and -b, can't be given together.
+//
+//	rtl_fm -f 433.51e6 -s 200000 -r 96000 2>/dev/null | ./EfergyRPI_log -o csv:efergy.csv -o udp:collector:5140
+//
+// 16/10/2026 - Added -T [cores] to run the sample reader on a thread of its own (see efergy_pipeline.h), so reading,
+//	IQ demodulation and decimation, decoding and writing the log happen on three cores, with a ring of blocks
+//	between the reader and the decoder to ride out stalls.  Only the reader is split off: the slicer and the frame
+//	decoder stay together on the decode thread, since a checksum error resamples the wave center right after the
+//	failed frame.  The cores of the reader, the decoder and the writer can be given, e.g. -T 1,2,3.  If the decoder
+//	falls behind for more than a moment whole blocks are dropped rather than holding up rtl_fm, and counted, and the
+//	decoder starts over after the gap instead of decoding across it.  Without -T everything but the writer stays on
+//	one thread, which is what a Pi Zero wants.
+//
+//	rtl_sdr -f 433.51e6 -s 288000 -g 19.7 - 2>/dev/null | ./EfergyRPI_log -i 288000 -T 1,2,3 efergy.csv
+//
+// 16/10/2026 - -f can be given more than once to decode several streams in one process, e.g. a dongle on 433.51 and one
+//	on 433.55 MHz, each rtl_fm writing to a FIFO.  Every stream gets its own decoder and wave center, the readings
+//	share the log writer, and one thread serves them all with poll(2).  The frames and checksum errors of each
+//	stream are reported on stderr at the end.
+//
+//	mkfifo /tmp/e1 /tmp/e2
+//	rtl_fm -d 0 -f 433.51e6 -s 200000 -r 96000 2>/dev/null > /tmp/e1 &
+//	rtl_fm -d 1 -f 433.55e6 -s 200000 -r 96000 2>/dev/null > /tmp/e2 &
+//	./EfergyRPI_log -t -f /tmp/e1 -f /tmp/e2 efergy.csv
+//
+#define _GNU_SOURCE		// pthread_setaffinity_np() for -T
 #include <stdio.h>
 #include <stdint.h>
 #include <time.h>
-#include <math.h>
 #include <stdlib.h> // For exit function
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include "efergy_reader.h"
+#include "efergy_slicer.h"
+#include "efergy_writer.h"
+#include "efergy_pool.h"
+#include "efergy_profile.h"
+#include "efergy_meter.h"
+#include "efergy_stamp.h"
+#include "efergy_watts.h"
+#include "efergy_preamble.h"
+#include "efergy_adapt.h"
+#include "efergy_decoder.h"
+#include "efergy_bench.h"
+#include "efergy_pipeline.h"
 
-// Standard definitions for  Efergy E2 classic decoding
-#define MINLOWBIT 		3 	/* Min number of positive samples for a logic 0 */
-#define MINHIGHBIT 		8	/* Min number of positive samples for a logic 1 */
-#define VOLTAGE			240	/* Refernce Volatage */
-
-// Alternate  definitions for the Efergy Elite 3.0 TPM (if used, comment out duplicates above)
-//#define MINLOWBIT 		3 	/* Min number of positive samples for a logic 0 */
-//#define MINHIGHBIT 		9	/* Min number of positive samples for a logic 1 */
-//#define VOLTAGE			1	/* For Efergy Elite 3.0 TPM,  set to 1 */
-
-#define E2BYTECOUNT		8	/* Efergy RF Message Byte Count */
-#define PREAMBLE_COUNT		40	/* Number of positive samples for a valid preamble */
-#define CENTERSAMP		100	/* Number of samples needed to compute for the wave center */
-#define FRAMEBITCOUNT	(E2BYTECOUNT*8)	/* Number of bits for the entire frame (not including preamble) */
-
+// The device specific definitions (bit thresholds, frame length, voltage, preamble) are now runtime
+// device profiles.  The E2 Classic and Elite 3.0 TPM values are in efergy_profile.h, select one with -d.
+// The decode loop itself is in efergy_decoder.h.
+#if DECODER_BLOCK < READER_BLOCK_BYTES/2
+#error "A block of the sample reader must fit in one decoder_block()"
+#endif
 #define LOGTYPE			1	// Allows changing line-endings - 0 is for Unix /n, 1 for Windows /r/n
-#define SAMPLES_TO_FLUSH	10	// Number of samples taken before writing to file.
+#define SAMPLES_TO_FLUSH	10	// Number of samples taken before writing to file (by the writer thread, see efergy_writer.h).
 					// Setting this too low will cause excessive wear to flash due to updates to
 					// filesystem! You have been warned! Set to 10 samples for 6 seconds = every min.
 								
-int loggingok;		// Global var indicating logging on or off
-int samplecount;	// Global var counter for samples taken since last flush
-FILE *fp;	 		// Global var file handle
+struct log_writer writer;	// Global log writer, prints readings and appends them to the log file
+struct device_profile *profile;	// Global device profile, the first one selected with -d
+struct meter_table meters;	// Global transmitter table, readings of unwanted transmitters are dropped here
+struct stamp_clock reading_clock;	// Global clock the readings are timed with
+int integer_readings;	// Readings are only worked out as integer milliwatts (-w)
+int track_center;	// Decoders follow the wave center continuously (-e)
+int squelch;		// Decoders skip the noise between bursts (-q)
+int correlate;		// Decoders find preambles with the correlator (-x)
+int positive_only;	// Decoders only key off pulses above center (-n)
+int correct_frames;	// Decoders repair frames one bit short of their checksum (-k)
+int learn_thresholds;	// Decoders learn the bit thresholds (-l)
+int checksum_errors = 1;	// Frames that fail their checksum are reported on stdout (not by EfergyRPI_001)
+struct adapt_table adapt;	// Global learned thresholds, loaded from and saved to the -l file
+
+// Copy of the learned thresholds the log writer thread saves, so the decode loop never waits for the file
+struct learn_save {
+	struct adapt_table table;
+	const char *name;	// The -l file
+	int failed;		// Saving it failed and was reported
+} learnsave;
+long sample_rate = PROFILE_RATE;	// Samples per second the decoders get (-R, or -D when averaging the input down)
 
 // This next part is for debug/analysis mode  which can be used to figure out frame formats and to tune frequency.
 // Debug/analysis mode runs as a completely separate loop instead of the standard decode loop.  In this mode, all samples received
@@ -144,10 +334,11 @@ FILE *fp;	 		// Global var file handle
 #define ANALYZEBITCOUNT	(ANALYZEBYTECOUNT*8)	/* Number of bits for the entire frame (not including preamble) */
 #define SAMPLES_PER_BIT			19
 #define SAMPLE_STORE_SIZE		(ANALYZEBITCOUNT*SAMPLES_PER_BIT)	
-int sample_storage[SAMPLE_STORE_SIZE];			
+int16_t sample_storage[SAMPLE_STORE_SIZE];			
 int sample_store_index;
 int sample_store_overrun;
 long analysis_wavecenter;	//  In analysis mode, center is defined as global so it can be changed in  the debug/analysis code.
+struct stamp_cache analysis_stamp;	// Timestamp cache of the analysis output
 
 int decode_bytes_from_pulse_counts(int pulse_store[], int pulse_store_index, unsigned char bytes[]) {
 	int i;
@@ -160,11 +351,11 @@ int decode_bytes_from_pulse_counts(int pulse_store[], int pulse_store_index, uns
 		bytes[i]=0;
 		
 	for (i=0;i<pulse_store_index;i++) {
-		if (pulse_store[i] > MINLOWBIT) {
+		if (pulse_store[i] > profile->minlowbit) {
 			dbit++;
 			bitpos++;	
 			bytedata = bytedata << 1;
-			if (pulse_store[i] > MINHIGHBIT)
+			if (pulse_store[i] > profile->minhighbit)
 				bytedata = bytedata | 0x1;
 			if (bitpos > 7) {
 				bytes[bytecount] = bytedata;
@@ -189,8 +380,7 @@ void display_frame_data(char *msg, unsigned char bytes[], int bytecount) {
 		tbyte += bytes[i];
 	
 	// Take a shot at calculating current...
-	double current_adc = (bytes[4] * 256) + bytes[5];
-	double result  = (VOLTAGE*current_adc) / ((double) (32768) / (double) pow(2,(signed char) bytes[6]));
+	double result  = watts_calc(profile->voltage, (bytes[4] * 256) + bytes[5], bytes[6]);
 	printf( msg);
 	for(i=0;i<bytecount;i++) 
 	  printf("%02x ",bytes[i]);
@@ -226,16 +416,12 @@ void analyze_efergy_message(int verbosity_level) {
 		avg_neg /= neg_count;
 	double difference = avg_neg + ((avg_pos-avg_neg)/2);
  
- 	time_t ltime; 
-	char buffer[80];
-	time( &ltime );
-	struct tm *curtime = localtime( &ltime );
-	strftime(buffer,80,"%x,%X", curtime); 
+ 	const char *buffer = stamp_format(&analysis_stamp, time(NULL), 0);
 	if (verbosity_level > 0) {
 		printf("\nAnalysis of rtl_fm sample data for frame received on %s\n", buffer);
 		printf("     Number of Samples: %6d\n", sample_store_index);
 		printf("    Avg. Sample Values: %6.0f (negative)   %6.0f (positive)\n", avg_neg, avg_pos);
-		printf("           Wave Center: %6.0f (this frame) %6d (last frame)\n", difference, analysis_wavecenter);
+		printf("           Wave Center: %6.0f (this frame) %6ld (last frame)\n", difference, analysis_wavecenter);
 	} else
 		printf("%s ", buffer);
 	analysis_wavecenter = difference; // Use the calculated wave center from this sample to process next frame
@@ -244,7 +430,7 @@ void analyze_efergy_message(int verbosity_level) {
 		int wrap_count=0;
 		printf("\nShowing raw rtl_fm sample data received between start of frame and end of frame\n");
 		for(i=0;i<sample_store_index;i++) {
-			printf("%6d ", sample_storage[i] - analysis_wavecenter);
+			printf("%6ld ", sample_storage[i] - analysis_wavecenter);
 			wrap_count++;
 			if (wrap_count >= 16) {
 				printf("\n");
@@ -263,17 +449,29 @@ void analyze_efergy_message(int verbosity_level) {
 	int space_count_storage[SAMPLE_STORE_SIZE];
 	int pulse_store_index=0;
 	int space_store_index=0;
-	int display_pulse_info=1;
-	for(i=0;i<sample_store_index;i++) {
-		int samplec = sample_storage[i] - analysis_wavecenter;
-		if (samplec < 0) {
+
+	// Let the slicer find the runs above/below center.  Samples exactly at center count as positive here,
+	// so neighbouring MID and HIGH runs are merged.  The run still open at the end is appended so every
+	// sample is accounted for, same as walking the samples one by one.
+	struct slicer slicer;
+	struct slicer_run runs[SAMPLE_STORE_SIZE+1];
+	int nruns;
+	slicer_init(&slicer, analysis_wavecenter, NULL);
+	nruns = slicer_process(&slicer, sample_storage, sample_store_index, runs);
+	if (slicer.len > 0) {
+		runs[nruns].sign = slicer.sign;
+		runs[nruns].len = slicer.len;
+		nruns++;
+	}
+	for(i=0;i<nruns;i++) {
+		if (runs[i].sign == SLICE_LOW) {
 			if (pulse_count > 0) {
 				pulse_count_storage[pulse_store_index++]=pulse_count;
 				if (display_pulse_details) printf("%2dP ", pulse_count);
 				wrap_count++;
 			}
 			pulse_count=0;
-			space_count++;
+			space_count += runs[i].len;
 		} else {
 			if (space_count > 0) {
 				space_count_storage[space_store_index++]=space_count;
@@ -281,7 +479,7 @@ void analyze_efergy_message(int verbosity_level) {
 				wrap_count++;
 			}
 			space_count=0;
-			pulse_count++;
+			pulse_count += runs[i].len;
 		}
 		if (wrap_count >= 16) {
 			if (display_pulse_details) printf("\n");
@@ -306,37 +504,44 @@ void analyze_efergy_message(int verbosity_level) {
 	if (verbosity_level>0) printf("\n");
 }
 
-void  run_in_analysis_mode(int verbosity_level) {
-	unsigned char bytearray[ANALYZEBYTECOUNT]; // Explicitly declare as unsigned char because depending on compiler, char may be unsigned or signed
+// Analyze every frame found in the samples of reader until they run out.  Returns the number of frames analyzed.
+unsigned long analysis_scan(struct sample_reader *reader, int verbosity_level) {
 	int prvsamp;
-	
-	sleep(1);
-	
-	printf("\nEfergy Power Monitor Decoder - Running in analysis mode using verbosity level %d\n\n", verbosity_level);
+	int cursamp;
+	unsigned long frames = 0;
+
+	// The sample counts above are for -r 96000, at other rates they are scaled to the same time.  Above 96000
+	// the store is too small for a whole frame and the end of it is cut off.
+	int min_positive = profile_scale(MIN_POSITIVE_PREAMBLE_SAMPLES, PROFILE_RATE, sample_rate);
+	int min_negative = profile_scale(MIN_NEGATIVE_PREAMBLE_SAMPLES, PROFILE_RATE, sample_rate);
+	int store_size = profile_scale(SAMPLE_STORE_SIZE, PROFILE_RATE, sample_rate);
+	if (store_size > SAMPLE_STORE_SIZE)
+		store_size = SAMPLE_STORE_SIZE;
+
 	analysis_wavecenter = 0;
+	stamp_cache_init(&analysis_stamp, 0);
 	
-	while( !feof(stdin) ) {
+	while( !reader->eof ) {
 
 		// Look for a valid Efergy Preamble sequence which we'll define as
 		// a sequence of at least MIN_PEAMBLE_SIZE positive and negative or negative and positive pulses. eg 50N+50P or 50P+50N
 		int negative_preamble_count=0;
 		int positive_preamble_count=0;
 		prvsamp = 0;
-		while ( !feof(stdin) ) {	
-			int cursamp  = (int16_t) (fgetc(stdin) | fgetc(stdin)<<8);			
+		while ( sample_reader_next(reader, &cursamp) ) {
 			// Check for preamble 
 			if ((prvsamp >= analysis_wavecenter) && (cursamp >= analysis_wavecenter)) {
 				positive_preamble_count++;
 			} else if ((prvsamp < analysis_wavecenter) && (cursamp < analysis_wavecenter)) {
 				negative_preamble_count++;				
 			} else if ((prvsamp >= analysis_wavecenter) && (cursamp < analysis_wavecenter)) {
-				if ((positive_preamble_count > MIN_POSITIVE_PREAMBLE_SAMPLES) &&
-					(negative_preamble_count > MIN_NEGATIVE_PREAMBLE_SAMPLES))
+				if ((positive_preamble_count > min_positive) &&
+					(negative_preamble_count > min_negative))
 					break;
 				negative_preamble_count=0;
 			} else if ((prvsamp < analysis_wavecenter) && (cursamp >= analysis_wavecenter)) {
-				if ((positive_preamble_count > MIN_POSITIVE_PREAMBLE_SAMPLES) &&
-					(negative_preamble_count > MIN_NEGATIVE_PREAMBLE_SAMPLES))
+				if ((positive_preamble_count > min_positive) &&
+					(negative_preamble_count > min_negative))
 					break;
 				positive_preamble_count=0;
 			}	
@@ -344,236 +549,1276 @@ void  run_in_analysis_mode(int verbosity_level) {
 		} // end of find preamble while loop
 			
 		sample_store_index=0;
-		while( !feof(stdin) ) {
-			int cursamp  = (int16_t) (fgetc(stdin) | fgetc(stdin)<<8);
+		while( sample_reader_next(reader, &cursamp) ) {
 			sample_storage[sample_store_index] = cursamp;
-			if (sample_store_index < (SAMPLE_STORE_SIZE-1))
+			if (sample_store_index < (store_size-1))
 				sample_store_index++;
 			else {
 				analyze_efergy_message(verbosity_level);
+				frames++;
 				break;
 			}
 		} // Frame processing while 
 	} // outermost while 
-	
+	return frames;
+}
+
+void  run_in_analysis_mode(struct sample_reader *reader, int verbosity_level) {
+	if (reader->files == NULL)
+		sleep(1);	// No need to wait when replaying captures
+
+	printf("\nEfergy Power Monitor Decoder - Running in analysis mode using verbosity level %d\n\n", verbosity_level);
+	analysis_scan(reader, verbosity_level);
+	sample_reader_close(reader);
 	exit(0);
 }
 
-int calculate_watts(unsigned char bytes[])
+// Check the frame's checksum and fill in everything but the time of *reading.  Returns 1
+// if the checksum matches.
+int decode_reading(const struct device_profile *prof, unsigned char bytes[], struct log_reading *reading)
 {
+	reading->id = ((uint32_t) bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+	reading->adc = (bytes[4] << 8) | bytes[5];
+	reading->exponent = (signed char) bytes[6];
+	reading->meter = -1;
+	reading->nsec = 0;
+	reading->corrected = 0;
 
-unsigned char tbyte;
-double current_adc;
-double result;
-int i;
+	/* if checksum matches get watt data */
 
-time_t ltime; 
-struct tm *curtime;
-char buffer[80];
+	if (frame_checksum_ok(prof, bytes))
+	{
+		reading->milliwatts = watts_milli(prof->voltage_milli, reading->adc, bytes[6]);
+		reading->watts = integer_readings ? 0 : watts_calc(prof->voltage, reading->adc, bytes[6]);
+		reading->valid = 1;
+		return 1;
+	}
+	reading->watts = 0;
+	reading->milliwatts = 0;
+	reading->valid = 0;
+	return 0;
+}
 
-	/* add all captured bytes and mask lower 8 bits */
+// Hand a reading to the writer thread, unless it comes from a transmitter that is not
+// wanted.  Frames that failed their checksum can't be told apart, so they are only
+// reported when no -m filter is given.
+void queue_reading(struct log_reading *reading)
+{
+	if (reading->valid) {
+		if (!meter_update(&meters, reading->id, reading->time, reading->milliwatts, &reading->meter))
+			return;
+	} else if (meters.nfilter > 0 || !checksum_errors)
+		return;
 
-	tbyte = 0;
+	/* formatting and file I/O happen on the writer thread */
+	log_writer_push(&writer, reading);
+}
 
-	for(i=0;i<7;i++)
-		tbyte += bytes[i];
+int calculate_watts(const struct device_profile *prof, unsigned char bytes[], int corrected)
+{
+struct log_reading reading;
+struct timespec now;
+int valid;
 
-	tbyte &= 0xff;
+	valid = decode_reading(prof, bytes, &reading);
+	reading.corrected = corrected;
+	stamp_clock_now(&reading_clock, &now);
+	reading.time = now.tv_sec;
+	reading.nsec = now.tv_nsec;
+	queue_reading(&reading);
+	return valid;
+}
 
-	/* if checksum matches get watt data */
+// Frame callback of the live decoder
+int live_frame_found(void *ctx, const struct device_profile *prof, unsigned char bytes[], unsigned long long pos, int corrected)
+{
+	(void) ctx;
+	(void) pos;
+	return calculate_watts(prof, bytes, corrected);
+}
 
-	if (tbyte == bytes[7])
-	{
-		time( &ltime );
-		curtime = localtime( &ltime );
-		strftime(buffer,80,"%x,%X", curtime);
-
-		current_adc = (bytes[4] * 256) + bytes[5];
-		result	= (VOLTAGE * current_adc) / ((double) 32768 / (double) pow(2,(signed char) bytes[6]));
-		printf("%s,%f\n",buffer,result);
-		if(loggingok) {
-		  if(LOGTYPE) {
-		    fprintf(fp,"%s,%f\r\n",buffer,result);
-		  } else {
-		    fprintf(fp,"%s,%f\n",buffer,result);
-		  }
-		  samplecount++;
-		  if(samplecount==SAMPLES_TO_FLUSH) {
-		    samplecount=0;
-		    fflush(fp);
-		  }
-		}
-		fflush(stdout);
+// Save the learned thresholds in learnsave, run by the log writer thread with log_writer_job()
+void save_learned(void *arg)
+{
+	struct learn_save *s = (struct learn_save *) arg;
+
+	if (adapt_save(&s->table, s->name) < 0 && !s->failed) {
+		perror("Failed to save learned thresholds");
+		s->failed = 1;
+	}
+}
+
+// Set up a decoder with the decode options given on the command line.  Exits if out of memory.
+void decoder_start(struct decoder *d, struct device_profile *const profiles[], int nprofiles,
+		int (*on_frame)(void *ctx, const struct device_profile *prof, unsigned char bytes[], unsigned long long pos, int corrected), void *ctx)
+{
+	if (decoder_init(d, profiles, nprofiles, on_frame, ctx) < 0) {
+		perror("Failed to allocate decoder");
+		exit(EXIT_FAILURE);
+	}
+	d->track = track_center;
+	d->squelch = squelch;
+	if (!positive_only)
+		decoder_invert(d);
+	d->correct = correct_frames;
+	if (learn_thresholds)
+		decoder_learn(d, &adapt);
+	if (correlate && decoder_correlate(d) < 0) {
+		perror("Failed to allocate correlator");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Print a binary log written with -b in the same format as the CSV log
+void print_binary_log(char *name)
+{
+	struct binlog_map map;
+	struct binlog_record rec;
+	struct stamp_cache stamp;
+
+	if (binlog_map_open(&map, name) < 0) {
+	    perror("Failed to open binary log!");
+	    exit(EXIT_FAILURE);
+	}
+	stamp_cache_init(&stamp, 0);
+	while (binlog_map_next(&map, &rec))
+		printf("%s,%f%s\n", stamp_format(&stamp, (time_t) rec.time, 0), rec.watts,
+			(rec.flags & BINLOG_FLAG_CORRECTED) ? ",corrected" : "");
+	binlog_map_close(&map);
+	exit(0);
+}
+
+// Summary of the transmitters heard, after a replay
+void print_meter_summary(void)
+{
+	struct meter *m;
+	int i;
+
+	for (i = 0; i < meters.count; i++) {
+		m = &meters.meters[i];
+		fprintf(stderr, "    Transmitter %08x: %lu readings over %ld s, last %s%lld.%03lld\n", (unsigned int) m->id,
+			m->readings, (long) (m->last_time - m->first_time), (m->last_milli < 0) ? "-" : "",
+			llabs(m->last_milli) / 1000, llabs(m->last_milli) % 1000);
+	}
+	if (meters.filtered > 0)
+		fprintf(stderr, "%lu readings of other transmitters dropped by -m\n", meters.filtered);
+	if (meters.overflow > 0)
+		fprintf(stderr, "%lu readings not tracked, more than %d transmitters\n", meters.overflow, METER_MAX);
+}
+
+// Corpus mode (-j): decode many recorded captures on all cores.  Long captures are cut
+// into chunks of about CORPUS_SECONDS of signal, each cut placed CORPUS_LOOKBACK samples
+// before a preamble of the selected profile so no frame is split, and every chunk is decoded by its own decoder
+// on the thread pool.  The frames are then merged in timestamp order and written out
+// through the log writer like live readings.
+//
+// Captures carry no timestamps of their own, so a capture is assumed to have ended at
+// its modification time, and its frames are timed back from there at sample_rate.
+#define CORPUS_SECONDS		60	/* Aim for one minute of signal per chunk */
+#define CORPUS_LOOKBACK		1000	/* Cut this many samples ahead of the preamble */
+
+struct corpus_frame {
+	double time;		/* Seconds since the epoch */
+	int file;
+	unsigned long long pos;	/* Sample in the capture */
+	struct log_reading reading;
+};
+
+struct corpus_chunk {
+	struct device_profile *const *profiles;	/* Profiles to decode with */
+	int nprofiles;
+	int file;
+	const int16_t *samples;
+	size_t count;
+	unsigned long long offset;	/* Position of samples[0] in the capture */
+	double start;		/* Time of the capture's first sample */
+	struct corpus_frame *frames;
+	size_t nframes;
+	size_t maxframes;
+	int lost;		/* Out of memory for frames, the list is short */
+	unsigned long frames_bad;
+};
+
+int corpus_frame_found(void *ctx, const struct device_profile *prof, unsigned char bytes[], unsigned long long pos, int corrected)
+{
+	struct corpus_chunk *c = (struct corpus_chunk *) ctx;
+	struct corpus_frame *f;
+	struct log_reading reading;
+
+	if (decode_reading(prof, bytes, &reading) == 0)
+		return 0;
+	if (c->lost)
 		return 1;
+	if (c->nframes == c->maxframes) {
+		f = (struct corpus_frame *) realloc(c->frames, (c->maxframes ? c->maxframes * 2 : 64) * sizeof(struct corpus_frame));
+		if (f == NULL) {
+			c->lost = 1;	/* reported once the pool is done */
+			return 1;
+		}
+		c->maxframes = c->maxframes ? c->maxframes * 2 : 64;
+		c->frames = f;
+	}
+	f = &c->frames[c->nframes++];
+	f->file = c->file;
+	f->pos = c->offset + pos;
+	f->time = c->start + (double) f->pos / sample_rate;
+	f->reading = reading;
+	f->reading.corrected = corrected;
+	f->reading.time = (time_t) f->time;
+	f->reading.nsec = (long) ((f->time - (double) f->reading.time) * 1e9);
+	return 1;
+}
+
+void corpus_decode_chunk(void *arg)
+{
+	struct corpus_chunk *c = (struct corpus_chunk *) arg;
+	struct decoder d;
+
+	decoder_start(&d, c->profiles, c->nprofiles, corpus_frame_found, c);	/* -l carries on from the file, nothing is saved */
+	decoder_process(&d, c->samples, c->count);
+	c->frames_bad = d.frames_bad;
+	decoder_free(&d);
+}
+
+int corpus_frame_order(const void *a, const void *b)
+{
+	const struct corpus_frame *fa = (const struct corpus_frame *) a;
+	const struct corpus_frame *fb = (const struct corpus_frame *) b;
+
+	if (fa->time != fb->time)
+		return (fa->time < fb->time) ? -1 : 1;
+	if (fa->file != fb->file)
+		return (fa->file < fb->file) ? -1 : 1;
+	return (fa->pos < fb->pos) ? -1 : (fa->pos > fb->pos);
+}
+
+// Look for a preamble (more than preamble_count samples above center) in samples
+// [from, to) and return where to cut ahead of it, or 0 if there is none.
+size_t corpus_find_cut(const int16_t *samples, size_t from, size_t to, int preamble_count)
+{
+	long center = 0;
+	size_t i;
+	int hctr = 0;
+
+	if (to - from < CENTERSAMP)
+		return 0;
+	for (i = from; i < from + CENTERSAMP; i++)
+		center += samples[i];
+	center /= CENTERSAMP;
+
+	for (; i < to; i++) {
+		if (samples[i] > center) {
+			if (++hctr > preamble_count && i + 1 - hctr >= from + CORPUS_LOOKBACK)
+				return i + 1 - hctr - CORPUS_LOOKBACK;
+		} else
+			hctr = 0;
 	}
-	printf("Checksum Error.  Try running program using -a [1-3] to analyze sample data\n");
 	return 0;
 }
 
-void  main (int argc, char**argv) 
+// Map one capture as little endian samples.  Returns NULL (after reporting) if it can't
+// be read, exits if out of memory.  Give the samples back with corpus_unmap().
+const int16_t *corpus_map(const char *name, size_t *count, double *end)
 {
+	struct stat st;
+	unsigned char *map;
+	int16_t *samples;
+	size_t i;
+	int fd;
 
-char bytearray[E2BYTECOUNT+1];
-char bytedata;
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < 2) {
+		if (fd < 0)
+			perror(name);
+		else
+			close(fd);
+		return NULL;
+	}
+	map = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(name);
+		return NULL;
+	}
+	*count = st.st_size / 2;
+	*end = (double) st.st_mtime;
+	samples = (int16_t *) map;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	samples = (int16_t *) malloc(*count * sizeof(int16_t));
+	if (samples == NULL) {
+		perror("Failed to allocate capture samples");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < *count; i++)
+		samples[i] = (int16_t) (map[2*i] | (map[2*i+1] << 8));
+	munmap(map, st.st_size);
+#else
+	(void) i;
+#endif
+	return samples;
+}
 
-int prvsamp;
-int hctr;
-int cursamp;
-int bitpos;
-int bytecount;
+void corpus_unmap(const int16_t *samples, size_t count)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	(void) count;
+	free((void *) samples);
+#else
+	munmap((void *) samples, count * sizeof(int16_t));
+#endif
+}
 
+void run_corpus_mode(char **files, int nfiles, int nthreads, struct device_profile *const profiles[], int nprofiles)
+{
+	struct corpus_chunk *chunks = NULL;
+	struct corpus_chunk *c;
+	struct corpus_frame *frames;
+	struct pool pool;
+	const int16_t **maps;
+	size_t *mapcounts;
+	const int16_t *samples;
+	size_t count, pos, cut, to;
+	size_t corpus_chunk = (size_t) sample_rate * CORPUS_SECONDS;
+	size_t nchunks = 0, maxchunks = 0;
+	size_t nframes = 0;
+	size_t i, k;
+	unsigned long long total_samples = 0;
+	unsigned long frames_bad = 0;
+	struct timespec start, end;
+	double elapsed;
+	double fend;
+	int preamble_count;
+	int f;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* cut ahead of the shortest preamble of all the profiles */
+
+	preamble_count = profiles[0]->preamble;
+	for (f = 1; f < nprofiles; f++)
+		if (profiles[f]->preamble < preamble_count)
+			preamble_count = profiles[f]->preamble;
+
+	/* cut every capture into chunks */
+
+	maps = (const int16_t **) calloc(nfiles, sizeof(*maps));
+	mapcounts = (size_t *) calloc(nfiles, sizeof(*mapcounts));
+	if (maps == NULL || mapcounts == NULL) {
+		perror("Failed to allocate capture list");
+		exit(EXIT_FAILURE);
+	}
+	for (f = 0; f < nfiles; f++) {
+		samples = corpus_map(files[f], &count, &fend);
+		if (samples == NULL)
+			continue;
+		maps[f] = samples;
+		mapcounts[f] = count;
+
+		total_samples += count;
+		pos = 0;
+		while (pos < count) {
+			cut = count;
+			if (count - pos > corpus_chunk + corpus_chunk/2) {
+				to = pos + 2*corpus_chunk;
+				if (to > count)
+					to = count;
+				cut = corpus_find_cut(samples, pos + corpus_chunk, to, preamble_count);
+				if (cut == 0 || cut >= count)
+					cut = count;	/* no preamble in sight, keep going in one piece */
+			}
+			if (nchunks == maxchunks) {
+				maxchunks = maxchunks ? maxchunks * 2 : 64;
+				chunks = (struct corpus_chunk *) realloc(chunks, maxchunks * sizeof(struct corpus_chunk));
+				if (chunks == NULL) {
+					perror("Failed to allocate chunk list");
+					exit(EXIT_FAILURE);
+				}
+			}
+			c = &chunks[nchunks++];
+			memset(c, 0, sizeof(*c));
+			c->profiles = profiles;
+			c->nprofiles = nprofiles;
+			c->file = f;
+			c->samples = samples + pos;
+			c->count = cut - pos;
+			c->offset = pos;
+			c->start = fend - (double) count / sample_rate;
+			pos = cut;
+		}
+	}
+
+	/* decode them on the pool */
+
+	if (pool_init(&pool, nthreads, nchunks) < 0) {
+		perror("Failed to start thread pool");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nchunks; i++)
+		pool_add(&pool, corpus_decode_chunk, &chunks[i]);
+	pool_run(&pool);
+	pool_free(&pool);
+	for (f = 0; f < nfiles; f++)
+		if (maps[f] != NULL)
+			corpus_unmap(maps[f], mapcounts[f]);
+	free(maps);
+	free(mapcounts);
+
+	/* merge in timestamp order, unless some frames were lost */
+
+	for (i = 0; i < nchunks; i++)
+		if (chunks[i].lost) {
+			fprintf(stderr, "Out of memory for the frames of %s\n", files[chunks[i].file]);
+			exit(EXIT_FAILURE);
+		}
+	for (i = 0; i < nchunks; i++) {
+		nframes += chunks[i].nframes;
+		frames_bad += chunks[i].frames_bad;
+	}
+	frames = (struct corpus_frame *) malloc((nframes ? nframes : 1) * sizeof(struct corpus_frame));
+	if (frames == NULL) {
+		perror("Failed to allocate frame list");
+		exit(EXIT_FAILURE);
+	}
+	nframes = 0;
+	for (i = 0; i < nchunks; i++) {
+		for (k = 0; k < chunks[i].nframes; k++)
+			frames[nframes++] = chunks[i].frames[k];
+		free(chunks[i].frames);
+	}
+	qsort(frames, nframes, sizeof(struct corpus_frame), corpus_frame_order);
+	for (i = 0; i < nframes; i++)
+		queue_reading(&frames[i].reading);
+	free(frames);
+	free(chunks);
+
+	log_writer_close(&writer);
+	if (writer.unsent > 0)
+		fprintf(stderr, "%lu readings could not be sent to the socket\n", writer.unsent);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "Decoded %d captures in %lu chunks on %d threads\n", nfiles, (unsigned long) nchunks, nthreads);
+	fprintf(stderr, "Replayed %llu samples (%.1f s of signal) in %.3f s, %.0f samples/sec (%.0fx real time)\n",
+		total_samples, total_samples / (double) sample_rate, elapsed, total_samples / elapsed,
+		total_samples / (double) sample_rate / elapsed);
+	fprintf(stderr, "Frames decoded: %lu, checksum errors: %lu\n", (unsigned long) nframes, frames_bad);
+	print_meter_summary();
+	exit(0);
+}
+
+// Benchmark mode (-B): time every stage of the decoder on the fixed sample buffers of
+// efergy_bench.h and print one CSV line per scenario and stage.  The stages are
+//
+//	slicer		the runs above and below center, slicer_process()
+//	decoder		the frame state machines on top of the slicer, decoder_process()
+//	watts		calculate_watts() of the frames found, through the log writer
+//	analysis	the -a frame scan, analysis_scan()
+//	pipeline	end to end, read(2) of the samples through the decoder and the writer
+//
+// Each stage is run over its buffer until at least min_time seconds have passed.  The
+// decode options given with -B (-n, -e, -q, -x, -k, -l, -d, -R) apply, so their cost can be
+// compared too.  Readings go to /dev/null; only the CSV is written to stdout.  The watts
+// stage never looks at the samples, so its per sample columns are -1.
+#define BENCH_MIN_TIME		0.5	/* Seconds each stage is run for, unless -B says otherwise */
+#define BENCH_MAX_FRAMES	4096	/* Frames kept from the decoder stage for the watts stage */
+
+struct bench_state {
+	struct device_profile *const *profiles;
+	int nprofiles;
+	const int16_t *samples;
+	size_t count;
+	int fd;			/* The same samples in a file, for the stages that read them */
+	struct slicer_run *runs;
+	unsigned long slicer_runs;	/* Runs of the last slicer pass */
+	const struct device_profile *frame_profile[BENCH_MAX_FRAMES];
+	unsigned char frame_bytes[BENCH_MAX_FRAMES][PROFILE_MAX_BYTES];
+	int nframes;
+};
+
+int bench_frame_found(void *ctx, const struct device_profile *prof, unsigned char bytes[], unsigned long long pos, int corrected)
+{
+	struct bench_state *b = (struct bench_state *) ctx;
+
+	(void) pos;
+	(void) corrected;
+	if (!frame_checksum_ok(prof, bytes))
+		return 0;
+	if (b->nframes < BENCH_MAX_FRAMES) {
+		b->frame_profile[b->nframes] = prof;
+		memcpy(b->frame_bytes[b->nframes], bytes, prof->bytecount);
+		b->nframes++;
+	}
+	return 1;
+}
+
+unsigned long bench_slicer(struct bench_state *b)
+{
+	struct slicer s;
+	unsigned long runs = 0;
+	size_t n, len;
+
+	slicer_init(&s, 0, NULL);
+	for (n = 0; n < b->count; n += len) {
+		len = (b->count - n > DECODER_BLOCK) ? DECODER_BLOCK : b->count - n;
+		runs += slicer_process(&s, b->samples + n, len, b->runs);
+	}
+	b->slicer_runs = runs;
+	return 0;
+}
+
+unsigned long bench_decoder(struct bench_state *b)
+{
+	struct decoder d;
+
+	b->nframes = 0;
+	decoder_start(&d, b->profiles, b->nprofiles, bench_frame_found, b);
+	decoder_process(&d, b->samples, b->count);
+	decoder_free(&d);
+	return b->nframes;
+}
+
+unsigned long bench_watts(struct bench_state *b)
+{
+	int i;
+
+	for (i = 0; i < b->nframes; i++)
+		calculate_watts(b->frame_profile[i], b->frame_bytes[i], 0);
+	log_writer_drain(&writer);
+	return b->nframes;
+}
+
+unsigned long bench_analysis(struct bench_state *b)
+{
+	struct sample_reader reader;
+	unsigned long frames;
+
+	if (lseek(b->fd, 0, SEEK_SET) < 0 || sample_reader_open(&reader, b->fd) < 0) {
+		perror("Failed to read benchmark samples");
+		exit(EXIT_FAILURE);
+	}
+	frames = analysis_scan(&reader, 0);
+	fflush(stdout);
+	sample_reader_close(&reader);
+	return frames;
+}
+
+unsigned long bench_pipeline(struct bench_state *b)
+{
+	struct sample_reader reader;
+	struct decoder d;
+	unsigned long frames;
+	size_t count;
+
+	if (lseek(b->fd, 0, SEEK_SET) < 0 || sample_reader_open(&reader, b->fd) < 0) {
+		perror("Failed to read benchmark samples");
+		exit(EXIT_FAILURE);
+	}
+	decoder_start(&d, b->profiles, b->nprofiles, live_frame_found, NULL);
+	while ((count = sample_reader_fill(&reader)) > 0)
+		decoder_block(&d, reader.buf, count);
+	log_writer_drain(&writer);
+	frames = d.frames_ok;
+	decoder_free(&d);
+	sample_reader_close(&reader);
+	return frames;
+}
+
+static const struct {
+	const char *name;
+	unsigned long (*run)(struct bench_state *b);
+	int samples;		/* Goes through the samples, so the per sample columns mean something */
+} bench_stages[] = {
+	{ "slicer", bench_slicer, 1 },
+	{ "decoder", bench_decoder, 1 },
+	{ "watts", bench_watts, 0 },
+	{ "analysis", bench_analysis, 1 },
+	{ "pipeline", bench_pipeline, 1 },
+};
+
+void run_benchmark_mode(struct device_profile *const profiles[], int nprofiles, double min_time)
+{
+	static struct bench_state b;
+	struct bench_counter ctr;
+	struct gen_buf buf = { NULL, 0, 0 };
+	char tmpname[] = "/tmp/efergy-bench-XXXXXX";
+	unsigned long frames;
+	long long insn, total_insn;
+	long reps;
+	double t, elapsed;
+	double ns_sample, ns_frame;
+	FILE *out;
+	int devnull;
+	int s, k;
+
+	/* the CSV goes to stdout, the readings and the analysis output to /dev/null */
+
+	fflush(stdout);
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	devnull = open("/dev/null", O_WRONLY);
+	if (out == NULL || devnull < 0 || dup2(devnull, STDOUT_FILENO) < 0) {
+		perror("Failed to redirect stdout");
+		exit(EXIT_FAILURE);
+	}
+	close(devnull);
+
+	if (log_writer_open(&writer, -1, -1, SAMPLES_TO_FLUSH, LOGTYPE) < 0) {
+		perror("Failed to start log writer");
+		exit(EXIT_FAILURE);
+	}
+	writer.wait = 1;
+	writer.integer = integer_readings;
+	stamp_clock_init(&reading_clock);
+
+	b.profiles = profiles;
+	b.nprofiles = nprofiles;
+	b.runs = (struct slicer_run *) malloc(DECODER_BLOCK * sizeof(struct slicer_run));
+	if (b.runs == NULL) {
+		perror("Failed to allocate slicer runs");
+		exit(EXIT_FAILURE);
+	}
+	b.fd = mkstemp(tmpname);
+	if (b.fd < 0) {
+		perror("Failed to create benchmark sample file");
+		exit(EXIT_FAILURE);
+	}
+	unlink(tmpname);
+	if (bench_counter_open(&ctr) < 0)
+		fprintf(stderr, "Instructions can't be counted here (see /proc/sys/kernel/perf_event_paranoid)\n");
+
+	fprintf(out, "scenario,stage,samples,frames,ns_per_sample,ns_per_frame,frames_per_sec,realtime,insn_per_sample,insn_per_frame\n");
+	for (s = 0; s < BENCH_SCENARIOS; s++) {
+		buf.n = 0;
+		if (bench_make(&bench_scenarios[s], profiles[0], sample_rate, &buf) < 0) {
+			perror("Failed to allocate sample buffer");
+			exit(EXIT_FAILURE);
+		}
+		if (ftruncate(b.fd, 0) < 0 || lseek(b.fd, 0, SEEK_SET) < 0 || bench_save(b.fd, buf.s, buf.n) < 0) {
+			perror("Failed to write benchmark samples");
+			exit(EXIT_FAILURE);
+		}
+		b.samples = buf.s;
+		b.count = buf.n;
+		b.nframes = 0;
+
+		for (k = 0; k < (int) (sizeof(bench_stages) / sizeof(bench_stages[0])); k++) {
+			if (bench_stages[k].run == bench_watts)
+				bench_decoder(&b);	/* the frames to work out */
+			bench_stages[k].run(&b);	/* warm up the caches */
+			reps = 0;
+			total_insn = 0;
+			t = bench_now();
+			do {
+				bench_counter_start(&ctr);
+				frames = bench_stages[k].run(&b);
+				insn = bench_counter_stop(&ctr);
+				total_insn = (insn < 0 || total_insn < 0) ? -1 : total_insn + insn;
+				reps++;
+				elapsed = bench_now() - t;
+			} while (elapsed < min_time);
+
+			/* per pass over the buffer */
+			elapsed /= reps;
+			ns_sample = bench_stages[k].samples ? elapsed * 1e9 / b.count : -1;
+			ns_frame = frames ? elapsed * 1e9 / frames : -1;
+			fprintf(out, "%s,%s,%lu,%lu,%.3f,%.1f,%.0f,%.1f,", bench_scenarios[s].name, bench_stages[k].name,
+				(unsigned long) b.count, frames, ns_sample, ns_frame, frames / elapsed,
+				bench_stages[k].samples ? 1e9 / (ns_sample * sample_rate) : -1.0);
+			if (total_insn < 0)
+				fprintf(out, "-1,-1\n");
+			else
+				fprintf(out, "%.2f,%.0f\n", bench_stages[k].samples ? (double) total_insn / reps / b.count : -1.0,
+					frames ? (double) total_insn / reps / frames : -1.0);
+			fflush(out);
+		}
+	}
+	close(b.fd);
+
+	bench_counter_close(&ctr);
+	free(buf.s);
+	free(b.runs);
+	log_writer_close(&writer);
+	fclose(out);
+	exit(0);
+}
+
+// Stream mode (several -f): decode the outputs of several rtl_fm (say one per dongle on
+// each of two frequencies, through FIFOs) in one process.  Every stream has its own
+// reader and decoder, so its own wave center, and the readings of all of them go through
+// the one log writer.  A single thread takes turns on the streams that poll(2) says have
+// data, reading one block of each at a time, so a busy stream can't starve the others.
+// The statistics of every stream are printed on stderr when they have all ended.
+struct input_stream {
+	const char *name;
+	struct sample_reader reader;
+	struct fm_demod fm;
+	struct decoder decoder;
+	unsigned long long samples;
+};
+
+void run_stream_mode(char **names, int nstreams, long iq_rate, long input_rate,
+		struct device_profile *const profiles[], int nprofiles)
+{
+	struct input_stream *streams;
+	struct input_stream *s;
+	struct pollfd *pfd;
+	int *index;
+	size_t count;
+	int nopen = 0;
+	int npoll;
+	int fd;
+	int i, k;
+
+	streams = (struct input_stream *) calloc(nstreams, sizeof(struct input_stream));
+	pfd = (struct pollfd *) calloc(nstreams, sizeof(struct pollfd));
+	index = (int *) calloc(nstreams, sizeof(int));
+	if (streams == NULL || pfd == NULL || index == NULL) {
+		perror("Failed to allocate streams");
+		exit(EXIT_FAILURE);
+	}
+
+	/* a FIFO only opens once its rtl_fm is there, the reads after that don't wait */
+
+	for (i = 0; i < nstreams; i++) {
+		s = &streams[i];
+		s->name = names[i];
+		fd = (strcmp(s->name, "-") == 0) ? STDIN_FILENO : open(s->name, O_RDONLY);
+		if (fd < 0) {
+			perror(s->name);
+			exit(EXIT_FAILURE);
+		}
+		if (sample_reader_open(&s->reader, fd) < 0) {
+			perror(s->name);
+			exit(EXIT_FAILURE);
+		}
+		if (iq_rate != 0 && (fm_demod_init(&s->fm, iq_rate, input_rate) < 0 || sample_reader_set_iq(&s->reader, &s->fm) < 0)) {
+			perror("Failed to allocate IQ buffer");
+			exit(EXIT_FAILURE);
+		}
+		if (sample_reader_set_decimation(&s->reader, input_rate / sample_rate) < 0) {
+			perror("Failed to allocate decimation buffer");
+			exit(EXIT_FAILURE);
+		}
+		decoder_start(&s->decoder, profiles, nprofiles, live_frame_found, NULL);
+		nopen++;
+	}
+
+	/* only once every input is open, so a failure doesn't leave stdin non-blocking */
+
+	for (i = 0; i < nstreams; i++)
+		if (sample_reader_nonblock(&streams[i].reader) < 0) {
+			perror(streams[i].name);
+			for (k = 0; k < i; k++)
+				sample_reader_close(&streams[k].reader);
+			exit(EXIT_FAILURE);
+		}
+
+	while (nopen > 0) {
+		npoll = 0;
+		for (i = 0; i < nstreams; i++) {
+			if (streams[i].reader.eof)
+				continue;
+			pfd[npoll].fd = streams[i].reader.fd;
+			pfd[npoll].events = POLLIN;
+			index[npoll++] = i;
+		}
+		if (poll(pfd, npoll, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		for (k = 0; k < npoll; k++) {
+			if (pfd[k].revents == 0)
+				continue;
+			s = &streams[index[k]];
+			count = sample_reader_fill(&s->reader);
+			if (count > 0) {
+				s->samples += count;
+				decoder_block(&s->decoder, s->reader.buf, count);
+			}
+			if (s->reader.eof)
+				nopen--;
+		}
+	}
+
+	log_writer_close(&writer);
+	if (writer.dropped > 0)
+		fprintf(stderr, "%lu readings dropped, log writer could not keep up\n", writer.dropped);
+	if (writer.unsent > 0)
+		fprintf(stderr, "%lu readings could not be sent to the socket\n", writer.unsent);
+	for (i = 0; i < nstreams; i++) {
+		s = &streams[i];
+		fprintf(stderr, "%s: %llu samples (%.1f s of signal), frames decoded: %lu, checksum errors: %lu, wave center %ld\n",
+			s->name, s->samples, s->samples / (double) sample_rate, s->decoder.frames_ok, s->decoder.frames_bad,
+			s->decoder.center);
+		if (s->decoder.squelch)
+			fprintf(stderr, "    Squelch: decoded %.1f%% of the samples\n",
+				100.0 * s->decoder.decoded / (s->samples ? s->samples : 1));
+		if (s->decoder.track)
+			fprintf(stderr, "    Wave center tracked on %lu good frames\n", s->decoder.bursts);
+		decoder_free(&s->decoder);
+		sample_reader_close(&s->reader);
+		if (s->reader.fd != STDIN_FILENO)
+			close(s->reader.fd);
+	}
+	print_meter_summary();
+	free(streams);
+	free(pfd);
+	free(index);
+	exit(0);
+}
+
+// There is one output of each kind (the CSV log, the binary log and the socket), so a
+// second one given on the command line is an error instead of quietly replacing the first.
+void set_output(char **name, char *value, const char *what)
+{
+	if (*name != NULL) {
+		fprintf(stderr, "Only one %s output can be given, not both %s and %s\n", what, *name, value);
+		exit(EXIT_FAILURE);
+	}
+	*name = value;
+}
+
+int  main (int argc, char**argv) 
+{
+
+struct decoder decoder;
+struct profile_table profiles;
+char *profile_names[DECODER_MAX_PROFILES];
+struct device_profile *decode_profiles[DECODER_MAX_PROFILES];
+struct device_profile rate_profiles[DECODER_MAX_PROFILES];	// The selected profiles at sample_rate
+int nprofiles = 0;
+char *config_name = NULL;
+struct sample_reader reader;
+struct fm_demod fm;
+size_t count;
+
+int argi;
 int i;
-int preamble;
-int frame;
-int dcenter;
-int dbit;
-
-long center;
-
-	if ((argc==2) && (strncmp(argv[1], "-h", 2)==0)) {
-	  printf("\nUsage: %s              - Normal mode\n",argv[0]);
-	  printf("       %s <filename>   - Normal mode plus log samples to output file\n", argv[0]);
-	  printf("       %s -a [0,1,2,3] - Run in debug/analysis mode.  Verbosity level (0-3) is optional\n",argv[0]);
-	  exit(0);
-	} else if ((argc==3) && (strncmp(argv[1], "-a", 2)==0)) {
-	  long verbosity_level = strtol(argv[2], NULL, 0);
-	  run_in_analysis_mode(verbosity_level);
-	} else if ((argc==2) && (strcmp(argv[1], "-a")==0))
-	  run_in_analysis_mode(2);
-	else if (argc==2) {
-	  fp = fopen(argv[1], "a"); // Log file opened in append mode to avoid destroying data
-	  samplecount=0; // Reset sample counter
-	  loggingok=1;
-	  if (fp == NULL) {
-	      perror("Failed to open log file!"); // Exit if file open fails
+int analysis_mode = 0;
+long verbosity_level = 2;
+long iq_rate = 0;
+long input_rate = PROFILE_RATE;
+long decimate_rate = 0;
+char *logname = NULL;
+char *inname = NULL;
+char *binname = NULL;
+char *sockname = NULL;
+char *sink;
+int outputs = 0;
+int to_stdout = 0;
+int sockfd = -1;
+char *learnname = NULL;
+uint32_t id;
+int tag = 0;
+long subsec = 0;
+int integer = 0;
+int split = 0;
+int infd = STDIN_FILENO;
+int logfd = -1;
+int binfd = -1;
+char **replay;
+int nreplay = 0;
+int nthreads = 0;
+char **inputs;
+int ninputs = 0;
+struct pipeline pipeline;
+int pipelined = 0;
+int pin[3] = { -1, -1, -1 };	// Cores of the reader, the decoder and the writer (-T)
+const int16_t *buf;
+char *cores;
+double bench_time = 0;
+
+unsigned long long total_samples = 0;
+unsigned long inverted;
+struct timespec start, end;
+double elapsed;
+
+	replay = (char **) malloc(argc * sizeof(char *));
+	inputs = (char **) malloc(argc * sizeof(char *));
+	if (replay == NULL || inputs == NULL) {
+	  perror("Failed to allocate replay list");
+	  exit(EXIT_FAILURE);
+	}
+
+	meter_table_init(&meters);
+
+#ifdef EFERGY_LEGACY_001
+	positive_only = 1;	// What EfergyRPI_001 always did, see there
+	checksum_errors = 0;
+#endif
+
+	for (argi = 1; argi < argc; argi++) {
+	  if (strncmp(argv[argi], "-h", 2)==0) {
+	    printf("\nUsage: %s [options]              - Normal mode\n",argv[0]);
+	    printf("       %s [options] <filename>   - Normal mode plus log samples to output file\n", argv[0]);
+	    printf("       %s [options] -a [0,1,2,3] - Run in debug/analysis mode.  Verbosity level (0-3) is optional\n",argv[0]);
+	    printf("\nOptions:\n");
+	    printf("       -i [rate]      - Input is raw cu8 IQ from rtl_sdr at the given rate (default %d) instead of rtl_fm output\n", FM_DEFAULT_IQ_RATE);
+	    printf("       -f <file>      - Read input from file instead of stdin.  Repeat to decode several streams at once,\n");
+	    printf("                        e.g. FIFOs fed by an rtl_fm per dongle (- is stdin)\n");
+	    printf("       -R <rate>      - Sample rate of the input, rtl_fm's -r (default %d).  With -i the rate to demodulate to\n", PROFILE_RATE);
+	    printf("       -D <rate>      - Average the input down to a lower rate before decoding, to compare rates on captures\n");
+	    printf("       -d <profile>   - Device profile, e2 (E2 Classic, default), elite (Elite 3.0 TPM) or one from -c.\n");
+	    printf("                        Repeat to decode transmitters of several profiles from the same signal\n");
+	    printf("       -c <file>      - Load device profiles from a config file\n");
+	    printf("       -t             - Put the transmitter id in every line, date,time,id,watts\n");
+	    printf("       -u [digits]    - Time readings to a fraction of a second, 3 digits (milliseconds) by default\n");
+	    printf("       -q             - Squelch, only decode around bursts and skip the noise in between\n");
+	    printf("       -l <file>      - Learn the bit thresholds from the signal, keeping them in this file across restarts\n");
+	    printf("       -k             - Repair frames that fail their checksum by one uncertain bit, marked \",corrected\"\n");
+	    printf("       -n             - Only decode pulses above the wave center, don't look for an inverted signal\n");
+	    printf("       -x             - Find preambles with a correlator that copes with noise inside them\n");
+	    printf("       -e             - Track the wave center on the preamble of every good frame instead of resampling it after checksum errors\n");
+	    printf("       -w             - Log readings as integer milliwatts, worked out without floating point\n");
+	    printf("       -m <id>        - Only log readings of the transmitter with this (hex) id.  Repeat for more\n");
+	    printf("       -s             - Log every transmitter to a file of its own, <filename> with the id added\n");
+	    printf("       -b <file>      - Also log readings to a compact binary file\n");
+	    printf("       -p <file>      - Print a binary log as CSV and exit\n");
+	    printf("       -o <output>    - Send the readings to stdout, csv:<file>, bin:<file> or udp:<host>:<port>.  Repeat\n");
+	    printf("                        for several, one of each kind.  Without -o they go to stdout (and <filename>\n");
+	    printf("                        and -b if given)\n");
+	    printf("       -r <file>      - Replay a recorded capture at full speed and report decode statistics.\n");
+	    printf("                        Repeat to replay several captures back to back\n");
+	    printf("       -j [threads]   - Decode the -r captures in parallel (default one thread per core) and\n");
+	    printf("                        print the readings merged in timestamp order\n");
+	    printf("       -T [r,d,w]     - Read the input on a thread of its own, optionally pinning the reader, decoder and\n");
+	    printf("                        writer to the given cores.  Only reading moves, the slicer and the frames are\n");
+	    printf("                        still decoded on one thread\n");
+	    printf("       -B [seconds]   - Benchmark the decode stages on made up signals, %.1f s each by default, and\n", BENCH_MIN_TIME);
+	    printf("                        print the timings as CSV\n");
+	    exit(0);
+	  } else if (strcmp(argv[argi], "-a")==0) {
+	    analysis_mode = 1;
+	    if ((argi+1 < argc) && (argv[argi+1][0] != '-'))
+	      verbosity_level = strtol(argv[++argi], NULL, 0);
+	  } else if (strcmp(argv[argi], "-i")==0) {
+	    iq_rate = FM_DEFAULT_IQ_RATE;
+	    if ((argi+1 < argc) && (argv[argi+1][0] >= '0') && (argv[argi+1][0] <= '9'))
+	      iq_rate = strtol(argv[++argi], NULL, 0);
+	  } else if ((strcmp(argv[argi], "-R")==0) && (argi+1 < argc)) {
+	    input_rate = strtol(argv[++argi], NULL, 0);
+	    if (input_rate <= 0) {
+	      fprintf(stderr, "Bad sample rate %s\n", argv[argi]);
+	      exit(EXIT_FAILURE);
+	    }
+	  } else if ((strcmp(argv[argi], "-D")==0) && (argi+1 < argc)) {
+	    decimate_rate = strtol(argv[++argi], NULL, 0);
+	    if (decimate_rate <= 0) {
+	      fprintf(stderr, "Bad sample rate %s\n", argv[argi]);
 	      exit(EXIT_FAILURE);
+	    }
+	  } else if ((strcmp(argv[argi], "-f")==0) && (argi+1 < argc)) {
+	    inputs[ninputs++] = argv[++argi];
+	  } else if ((strcmp(argv[argi], "-d")==0) && (argi+1 < argc)) {
+	    if (nprofiles == DECODER_MAX_PROFILES) {
+	      fprintf(stderr, "At most %d device profiles can be decoded at once\n", DECODER_MAX_PROFILES);
+	      exit(EXIT_FAILURE);
+	    }
+	    profile_names[nprofiles++] = argv[++argi];
+	  } else if ((strcmp(argv[argi], "-c")==0) && (argi+1 < argc)) {
+	    config_name = argv[++argi];
+	  } else if (strcmp(argv[argi], "-t")==0) {
+	    tag = 1;
+	  } else if (strcmp(argv[argi], "-u")==0) {
+	    subsec = 3;
+	    if ((argi+1 < argc) && (argv[argi+1][0] >= '0') && (argv[argi+1][0] <= '9'))
+	      subsec = strtol(argv[++argi], NULL, 0);
+	    if (subsec > 9)
+	      subsec = 9;
+	  } else if (strcmp(argv[argi], "-q")==0) {
+	    squelch = 1;
+	  } else if ((strcmp(argv[argi], "-l")==0) && (argi+1 < argc)) {
+	    learnname = argv[++argi];
+	  } else if (strcmp(argv[argi], "-k")==0) {
+	    correct_frames = 1;
+	  } else if (strcmp(argv[argi], "-n")==0) {
+	    positive_only = 1;
+	  } else if (strcmp(argv[argi], "-x")==0) {
+	    correlate = 1;
+	  } else if (strcmp(argv[argi], "-e")==0) {
+	    track_center = 1;
+	  } else if (strcmp(argv[argi], "-w")==0) {
+	    integer = 1;
+	  } else if (strcmp(argv[argi], "-s")==0) {
+	    split = 1;
+	  } else if ((strcmp(argv[argi], "-m")==0) && (argi+1 < argc)) {
+	    if (meter_parse_id(argv[++argi], &id) < 0 || meter_filter_add(&meters, id) < 0) {
+	      fprintf(stderr, "Bad transmitter id %s, or more than %d of them\n", argv[argi], METER_MAX);
+	      exit(EXIT_FAILURE);
+	    }
+	  } else if ((strcmp(argv[argi], "-b")==0) && (argi+1 < argc)) {
+	    set_output(&binname, argv[++argi], "binary log");
+	  } else if ((strcmp(argv[argi], "-o")==0) && (argi+1 < argc)) {
+	    sink = argv[++argi];
+	    outputs++;
+	    if (strcmp(sink, "stdout")==0)
+	      to_stdout = 1;
+	    else if ((strncmp(sink, "csv:", 4)==0) && (sink[4] != '\0'))
+	      set_output(&logname, sink + 4, "CSV log");
+	    else if ((strncmp(sink, "bin:", 4)==0) && (sink[4] != '\0'))
+	      set_output(&binname, sink + 4, "binary log");
+	    else if ((strncmp(sink, "udp:", 4)==0) && (sink[4] != '\0'))
+	      set_output(&sockname, sink + 4, "udp");
+	    else {
+	      fprintf(stderr, "Unknown output %s, expected stdout, csv:<file>, bin:<file> or udp:<host>:<port>\n", sink);
+	      exit(EXIT_FAILURE);
+	    }
+	  } else if ((strcmp(argv[argi], "-r")==0) && (argi+1 < argc)) {
+	    replay[nreplay++] = argv[++argi];
+	  } else if (strcmp(argv[argi], "-j")==0) {
+	    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	    if ((argi+1 < argc) && (argv[argi+1][0] >= '0') && (argv[argi+1][0] <= '9'))
+	      nthreads = strtol(argv[++argi], NULL, 0);
+	    if (nthreads < 1)
+	      nthreads = 1;
+	  } else if (strcmp(argv[argi], "-T")==0) {
+	    pipelined = 1;
+	    if ((argi+1 < argc) && (argv[argi+1][0] >= '0') && (argv[argi+1][0] <= '9')) {
+	      cores = argv[++argi];
+	      for (i = 0; i < 3 && *cores != '\0'; i++) {
+		pin[i] = strtol(cores, &cores, 0);
+		if (*cores == ',')
+		  cores++;
+	      }
+	      if (*cores != '\0') {
+		fprintf(stderr, "Bad core list %s, expected reader,decoder,writer\n", argv[argi]);
+		exit(EXIT_FAILURE);
+	      }
+	    }
+	  } else if (strcmp(argv[argi], "-B")==0) {
+	    bench_time = BENCH_MIN_TIME;
+	    if ((argi+1 < argc) && (argv[argi+1][0] >= '0') && (argv[argi+1][0] <= '9'))
+	      bench_time = strtod(argv[++argi], NULL);
+	  } else if ((strcmp(argv[argi], "-p")==0) && (argi+1 < argc)) {
+	    print_binary_log(argv[++argi]);
+	  } else
+	    set_output(&logname, argv[argi], "CSV log");
+	}
+
+	profile_table_init(&profiles);
+	if ((config_name != NULL) && (profile_load(&profiles, config_name) < 0))
+	  exit(EXIT_FAILURE);
+	if (nprofiles == 0)
+	  profile_names[nprofiles++] = "e2";
+	for (i = 0; i < nprofiles; i++) {
+	  decode_profiles[i] = profile_find(&profiles, profile_names[i]);
+	  if (decode_profiles[i] == NULL) {
+	    fprintf(stderr, "Unknown device profile %s\n", profile_names[i]);
+	    exit(EXIT_FAILURE);
 	  }
-	} else {
-	  loggingok=0;
 	}
 
-	printf("Efergy E2 Classic decode \n\n");
+	sample_rate = input_rate;
+	if (decimate_rate != 0) {
+	  if (decimate_rate > input_rate || input_rate % decimate_rate != 0) {
+	      fprintf(stderr, "-D rate must divide the input rate %ld\n", input_rate);
+	      exit(EXIT_FAILURE);
+	  }
+	  sample_rate = decimate_rate;
+	}
+	for (i = 0; i < nprofiles; i++) {
+	  profile_at_rate(&rate_profiles[i], decode_profiles[i], sample_rate);
+	  decode_profiles[i] = &rate_profiles[i];
+	}
+	profile = decode_profiles[0];	// Analysis mode works with the first one
 
-	/* initialize variables */
-	
-	cursamp = 0;
-	prvsamp = 0;
+	if (learnname != NULL) {
+	  if (adapt_load(&adapt, learnname) < 0)
+	    exit(EXIT_FAILURE);
+	  learnsave.name = learnname;
+	  learn_thresholds = 1;
+	}
 
-	bytedata = 0;
-	bytecount = 0;
-	hctr = 0;
-	bitpos = 0;
-	dbit = 0;
-	preamble = 0;
-	frame = 0;
+	integer_readings = integer;
+	if (bench_time > 0)
+	  run_benchmark_mode(decode_profiles, nprofiles, bench_time);
 
-	dcenter = CENTERSAMP;
-	center = 0;
+	if (ninputs > 1 && (nreplay > 0 || analysis_mode || nthreads > 0 || pipelined || learnname != NULL)) {
+	  fprintf(stderr, "Several -f inputs can't be used with -r, -a, -j, -T or -l\n");
+	  exit(EXIT_FAILURE);
+	}
+	if (ninputs == 1 && strcmp(inputs[0], "-") != 0)
+	  inname = inputs[0];
+	if (inname != NULL) {
+	  infd = open(inname, O_RDONLY);
+	  if (infd < 0) {
+	      perror("Failed to open input file!");
+	      exit(EXIT_FAILURE);
+	  }
+	}
+	if (((nreplay > 0) ? sample_reader_open_files(&reader, replay, nreplay) : sample_reader_open(&reader, infd)) < 0) {
+	  perror("Failed to allocate sample buffer");
+	  exit(EXIT_FAILURE);
+	}
+	if (iq_rate != 0) {
+	  if (fm_demod_init(&fm, iq_rate, input_rate) < 0) {
+	      fprintf(stderr, "IQ sample rate must be a multiple of %ld\n", input_rate);
+	      exit(EXIT_FAILURE);
+	  }
+	  if (sample_reader_set_iq(&reader, &fm) < 0) {
+	      perror("Failed to allocate IQ buffer");
+	      exit(EXIT_FAILURE);
+	  }
+	}
+	if (sample_reader_set_decimation(&reader, input_rate / sample_rate) < 0) {
+	  perror("Failed to allocate decimation buffer");
+	  exit(EXIT_FAILURE);
+	}
 
-	while( !feof(stdin) ) 
-	{
+	if (analysis_mode)
+	  run_in_analysis_mode(&reader, verbosity_level);
+	else if (split) {
+	  if (logname == NULL) {
+	      fprintf(stderr, "-s needs a log file name\n");
+	      exit(EXIT_FAILURE);
+	  }
+	} else if (logname != NULL) {
+	  logfd = open(logname, O_WRONLY | O_CREAT | O_APPEND, 0644); // Log file opened in append mode to avoid destroying data
+	  if (logfd < 0) {
+	      perror("Failed to open log file!"); // Exit if file open fails
+	      exit(EXIT_FAILURE);
+	  }
+	}
+	if (!analysis_mode && binname != NULL) {
+	  binfd = binlog_open(binname); // Cuts off a block torn by a crash, then appends
+	  if (binfd < 0) {
+	      perror("Failed to open binary log file!");
+	      exit(EXIT_FAILURE);
+	  }
+	}
+	if (!analysis_mode && sockname != NULL) {
+	  sockfd = log_socket_open(sockname);
+	  if (sockfd < 0)
+	      exit(EXIT_FAILURE);
+	}
+	if (outputs == 0)
+	  to_stdout = 1;
 
-		cursamp  = (int16_t) (fgetc(stdin) | fgetc(stdin)<<8);
+	if (to_stdout)
+	  printf("Efergy E2 Classic decode \n\n");
 
-		/* initially capture CENTERSAMP samples for wave center computation */
-		
-		if (dcenter > 0)
-		{
-			dcenter--;
-			center = center + cursamp;	/* Accumulate FSK wave data */ 
+	if (log_writer_open(&writer, logfd, binfd, SAMPLES_TO_FLUSH, LOGTYPE) < 0) {
+	  perror("Failed to start log writer");
+	  exit(EXIT_FAILURE);
+	}
+	writer.outfd = to_stdout ? STDOUT_FILENO : -1;
+	writer.sockfd = sockfd;
+	writer.wait = (nreplay > 0);	// Replay outruns real time, don't drop readings
+	writer.tag = tag;
+	writer.subsec = subsec;
+	writer.integer = integer;
+	stamp_clock_init(&reading_clock);
+	if (split && log_writer_split(&writer, logname) < 0) {
+	  perror("Failed to allocate per transmitter logs");
+	  exit(EXIT_FAILURE);
+	}
 
-			if (dcenter == 0)
-			{
-				/* compute for wave center and re-initialize frame variables */
+	if (nthreads > 0) {
+	  if (nreplay == 0 || iq_rate != 0 || decimate_rate != 0 || analysis_mode) {
+	      fprintf(stderr, "-j needs rtl_fm captures given with -r, and no -D\n");
+	      exit(EXIT_FAILURE);
+	  }
+	  run_corpus_mode(replay, nreplay, nthreads, decode_profiles, nprofiles);
+	}
+	if (ninputs > 1)
+	  run_stream_mode(inputs, ninputs, iq_rate, input_rate, decode_profiles, nprofiles);
 
-				center = (long) (center/CENTERSAMP);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-				hctr  = 0;
-				bytedata = 0;
-				bytecount = 0;
-				bitpos = 0;
-				dbit = 0;
-				preamble = 0;
-				frame = 0;
-			}
+	decoder_start(&decoder, decode_profiles, nprofiles, live_frame_found, NULL);
 
-		}
-		else
-		{
-			if ((cursamp > center) && (prvsamp < center))		/* Detect for positive edge of frame data */
-				hctr = 0;
-			else 
-				if ((cursamp > center) && (prvsamp > center))		/* count samples at high logic */
-				{
-					hctr++;
-					if (hctr > PREAMBLE_COUNT)	
-						preamble = 1;
-				}
-				else 
-					if (( cursamp < center) && (prvsamp > center))
-					{
-						/* at negative edge */
-
-						if ((hctr > MINLOWBIT) && (frame == 1))
-						{
-							dbit++;
-							bitpos++;	
-							bytedata = bytedata << 1;
-							if (hctr > MINHIGHBIT)
-								bytedata = bytedata | 0x1;
-
-							if (bitpos > 7)
-							{
-								bytearray[bytecount] = bytedata;
-								bytedata = 0;
-								bitpos = 0;
-
-								bytecount++;
-
-								if (bytecount == E2BYTECOUNT)
-								{
-
-									/* at this point check for checksum and calculate watt data */
-									/* if there is a checksum mismatch compute for a new wave center */
-
-									if (calculate_watts(bytearray) == 0)
-										dcenter = CENTERSAMP;	/* make dcenter non-zero to trigger center resampling */
-								}
-							}
-							
-							if (dbit > FRAMEBITCOUNT)
-							{	
-								/* reset frame variables */
-
-								bitpos = 0;
-								bytecount = 0;
-								dbit = 0;
-								frame = 0;
-								preamble = 0;
-								bytedata = 0;
-							}
-						}
-
-						hctr = 0;
-
-					} 
-					else
-						hctr = 0;
-
-			if ((hctr == 0) && (preamble == 1))
-			{
-				/* end of preamble, start of frame data */
-				preamble = 0;
-				frame = 1;
-			}
+	if (pipelined) {
+	  if (pin[1] >= 0 && pipeline_pin(pthread_self(), pin[1]) < 0)
+	      fprintf(stderr, "Can't run the decoder on core %d\n", pin[1]);
+	  if (pin[2] >= 0 && pipeline_pin(writer.thread, pin[2]) < 0)
+	      fprintf(stderr, "Can't run the writer on core %d\n", pin[2]);
+	  if (pipeline_start(&pipeline, &reader, nreplay > 0, pin[0]) < 0) {	// Replays wait for the decoder, no drops
+	      perror("Failed to start reader thread");
+	      exit(EXIT_FAILURE);
+	  }
+	}
 
-		} /* dcenter */
+	for (;;)
+	{
+	    if (pipelined) {
+		count = pipeline_next(&pipeline, &buf);
+		if (pipeline.gap > 0)
+		    decoder_skip(&decoder, pipeline.gap);	// Blocks were dropped, don't join the samples around them
+	    } else {
+		count = sample_reader_fill(&reader);
+		buf = reader.buf;
+	    }
+	    if (count == 0)
+		break;
+	    total_samples += count;
+	    decoder_block(&decoder, buf, count);
+	    if (pipelined)
+		pipeline_release(&pipeline);
+	    if (decoder.learn_dirty && log_writer_idle(&writer)) {
+		decoder_learned(&decoder, &adapt);
+		learnsave.table = adapt;
+		log_writer_job(&writer, save_learned, &learnsave);	// The file is written on the writer thread
+	    }
+	}
+	if (decoder.learn)
+	    decoder_learned(&decoder, &adapt);
 
-		prvsamp = cursamp;
+	if (pipelined)
+	    pipeline_stop(&pipeline);
+	decoder_free(&decoder);
+	sample_reader_close(&reader);
+	log_writer_close(&writer); // If rtl-fm gives EOF and program terminates, write out and close file gracefully.
+	if (learn_thresholds) {
+	    learnsave.table = adapt;	// The writer thread is gone, so the last save is made here
+	    save_learned(&learnsave);
+	}
+	if (pipelined && pipeline.dropped > 0)
+	    fprintf(stderr, "%lu blocks (%llu samples) dropped, the decoder could not keep up\n", pipeline.dropped, pipeline.dropped_samples);
+	if (writer.dropped > 0)
+	    fprintf(stderr, "%lu readings dropped, log writer could not keep up\n", writer.dropped);
+	if (writer.unsent > 0)
+	    fprintf(stderr, "%lu readings could not be sent to the socket\n", writer.unsent);
 
-	} /* while */
-	if(loggingok) {
-	    fclose(fp); // If rtl-fm gives EOF and program terminates, close file gracefully.
+	if (nreplay > 0) {
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+	    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	    fprintf(stderr, "Replayed %llu samples (%.1f s of signal) in %.3f s, %.0f samples/sec (%.0fx real time)\n",
+		total_samples, total_samples / (double) sample_rate, elapsed, total_samples / elapsed, total_samples / (double) sample_rate / elapsed);
+	    fprintf(stderr, "Frames decoded: %lu, checksum errors: %lu\n", decoder.frames_ok, decoder.frames_bad);
+	    if (decoder.squelch)
+		fprintf(stderr, "Squelch: decoded %.1f%% of the samples\n", 100.0 * decoder.decoded / (total_samples ? total_samples : 1));
+	    if (decoder.track)
+		fprintf(stderr, "Wave center tracked on %lu good frames, now at %ld\n", decoder.bursts, decoder.center);
+	    if (decoder.correlate)
+		fprintf(stderr, "Correlator: %lu preambles, average score %.0f%%\n", decoder.preambles,
+		    100.0 * decoder.score / ((decoder.preambles ? decoder.preambles : 1) * (decoder.corr.low + decoder.corr.high)));
+	    if (decoder.nframes > 1)
+		for (i = 0; i < decoder.nframes; i++)
+		    fprintf(stderr, "    %-12s frames decoded: %lu, checksum errors: %lu\n", decoder.frames[i].profile->name,
+			decoder.frames[i].frames_ok + decoder.frames[decoder.nframes + i].frames_ok,
+			decoder.frames[i].frames_bad + decoder.frames[decoder.nframes + i].frames_bad);
+	    if (decoder.correct)
+		fprintf(stderr, "Frames repaired by flipping a bit: %lu\n", decoder.corrected);
+	    if (decoder.learn)
+		for (i = 0; i < 2 * decoder.nframes; i++)
+		    if (decoder.frames[i].frames_ok > 0)
+			fprintf(stderr, "    %-12s %s pulses %.2f / %.2f samples, minlowbit %d, minhighbit %d, preamble %d\n",
+			    decoder.frames[i].profile->name, decoder.frames[i].inverted ? "inverted" : "learned",
+			    (double) decoder.frames[i].means.shrt / (1 << ADAPT_SHIFT),
+			    (double) decoder.frames[i].means.lng / (1 << ADAPT_SHIFT),
+			    decoder.frames[i].minlowbit, decoder.frames[i].minhighbit, decoder.frames[i].preamble_count);
+	    if (decoder.invert) {
+		inverted = 0;
+		for (i = 0; i < decoder.nframes; i++)
+		    inverted += decoder.frames[decoder.nframes + i].frames_ok;
+		fprintf(stderr, "Frames decoded from the inverted signal: %lu\n", inverted);
+	    }
+	    if (pipelined)
+		fprintf(stderr, "Pipeline: at most %d of %d blocks waiting for the decoder\n", pipeline.peak, PIPELINE_BLOCKS);
+	    print_meter_summary();
 	}
+	free(replay);
+	free(inputs);
+	return 0;
 }
 
@@ -0,0 +1,187 @@
+/*---------------------------------------------------------------------
+
+EFERGY SLICER CHECK
+
+Runs generated signals through slicer_process() in blocks of random length and compares
+the runs with what the plain C reference (the slicer_process() of a -DSLICER_SCALAR build)
+makes of the whole buffer in one go.  Every run has to come out the same, and so does the
+run left in progress at the end.  Exits with 1 if anything differs.
+
+The vector path checked is the one the compiler flags pick, see efergy_slicer.h, so build
+it once for every path in use:
+
+Compile:
+
+gcc -O2 -o EfergyRPI_slicecheck EfergyRPI_slicecheck.c			(SSE2 on x86-64)
+gcc -O2 -mavx2 -o EfergyRPI_slicecheck EfergyRPI_slicecheck.c		(AVX2)
+gcc -O2 -mfpu=neon -o EfergyRPI_slicecheck EfergyRPI_slicecheck.c	(NEON on 32 bit ARM)
+
+Example:
+
+./EfergyRPI_slicecheck
+./EfergyRPI_slicecheck 2000
+	(frames per signal, default 200)
+
+--------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "efergy_gen.h"
+#include "efergy_slicer.h"
+
+#define CHECK_MAX_BLOCK		4096	/* Longest block handed to slicer_process() */
+#define CHECK_MAX_REPORTS	10	/* Differences printed per signal */
+
+#if defined(SLICER_AVX2)
+#define CHECK_PATH	"AVX2"
+#elif defined(SLICER_SSE2)
+#define CHECK_PATH	"SSE2"
+#elif defined(SLICER_NEON)
+#define CHECK_PATH	"NEON"
+#else
+#define CHECK_PATH	"scalar"
+#endif
+
+struct signal {
+	const char *name;
+	double noise;
+	double jitter;
+	double dc;
+	double drift;
+	double level;
+	long rate;
+	int inverted;
+};
+
+static const struct signal signals[] = {
+	{ "clean",		0,	0,	0,	0,	GEN_LEVEL,	PROFILE_RATE,	0 },
+	{ "rough",		2500,	5,	-3000,	50,	GEN_LEVEL,	PROFILE_RATE,	1 },
+	{ "288000",		1000,	2,	500,	0,	GEN_LEVEL,	288000,		0 },
+	/* a weak signal lands right on the center a lot */
+	{ "weak",		1,	0,	0,	0,	2,		PROFILE_RATE,	0 },
+	/* and a loud one clips at both ends */
+	{ "clipped",		0,	0,	0,	0,	40000,		PROFILE_RATE,	1 },
+};
+
+#define CHECK_SIGNALS	((int) (sizeof(signals) / sizeof(signals[0])))
+
+// Slices s[0 .. n) against center both ways.  Returns the number of differences.
+unsigned long check_center(struct gen *g, const int16_t *s, size_t n, long center, int carry,
+		struct slicer_run *want, struct slicer_run *got, const char *name)
+{
+	struct slicer ref, sl;
+	size_t nwant, ngot = 0;
+	size_t i, len;
+	unsigned long bad = 0;
+
+	/* with carry the run in progress starts with the sample before the buffer */
+	slicer_init(&ref, center, carry ? s : NULL);
+	slicer_init(&sl, center, carry ? s : NULL);
+	if (carry) {
+	  s++;
+	  n--;
+	}
+	nwant = slicer_process_scalar(&ref, s, n, want);
+	for (i = 0; i < n; i += len) {
+	  len = 1 + gen_random(g) % CHECK_MAX_BLOCK;
+	  if (len > n - i)
+	    len = n - i;
+	  ngot += slicer_process(&sl, s + i, len, got + ngot);
+	}
+
+	if (ngot != nwant) {
+	  printf("%s, center %ld: %zu runs, should be %zu\n", name, center, ngot, nwant);
+	  bad++;
+	}
+	for (i = 0; i < ngot && i < nwant; i++)
+	  if (got[i].sign != want[i].sign || got[i].len != want[i].len) {
+	    if (bad++ < CHECK_MAX_REPORTS)
+	      printf("%s, center %ld: run %zu is %d x %u, should be %d x %u\n", name, center, i,
+		got[i].sign, got[i].len, want[i].sign, want[i].len);
+	  }
+	if (sl.sign != ref.sign || sl.len != ref.len) {
+	  printf("%s, center %ld: left %d x %u in progress, should be %d x %u\n", name, center,
+		sl.sign, sl.len, ref.sign, ref.len);
+	  bad++;
+	}
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+struct profile_table profiles;
+const struct device_profile *profile;
+struct gen_params params;
+struct gen gen;
+struct gen_buf buf;
+struct slicer_run *want, *got;
+unsigned char bytes[PROFILE_MAX_BYTES];
+long centers[6];
+long frames = 200;
+long f;
+unsigned long bad, sliced = 0;
+int failed = 0;
+int i, c;
+
+	if (argc > 1)
+	  frames = strtol(argv[1], NULL, 0);
+	if (frames <= 0) {
+	  fprintf(stderr, "Bad number of frames %s\n", argv[1]);
+	  exit(EXIT_FAILURE);
+	}
+	profile_table_init(&profiles);
+	profile = profile_find(&profiles, "e2");
+
+	printf("Checking the %s slicer\n", CHECK_PATH);
+	for (i = 0; i < CHECK_SIGNALS; i++) {
+	  gen_params_init(&params);
+	  params.noise = signals[i].noise;
+	  params.jitter = signals[i].jitter;
+	  params.dc = signals[i].dc;
+	  params.drift = signals[i].drift;
+	  params.level = signals[i].level;
+	  params.rate = signals[i].rate;
+	  params.inverted = signals[i].inverted;
+	  params.gap = 0.01;
+	  params.seed = i + 1;
+	  gen_init(&gen, &params);
+	  buf.s = NULL;
+	  buf.n = buf.max = 0;
+	  for (f = 0; f < frames; f++) {
+	    gen_frame_bytes(profile, 0x0912a4b0, 100 + 50 * f, bytes);
+	    if (gen_frame(&gen, &buf, bytes, profile->bytecount) < 0) {
+	      fprintf(stderr, "Out of memory\n");
+	      exit(EXIT_FAILURE);
+	    }
+	  }
+	  want = (struct slicer_run *) malloc(buf.n * sizeof(struct slicer_run));
+	  got = (struct slicer_run *) malloc(buf.n * sizeof(struct slicer_run));
+	  if (want == NULL || got == NULL) {
+	    fprintf(stderr, "Out of memory\n");
+	    exit(EXIT_FAILURE);
+	  }
+
+	  /* the decoder's center and a few that put it right on the samples or the limits */
+	  centers[0] = (long) params.dc;
+	  centers[1] = buf.s[buf.n / 2];
+	  centers[2] = 1;
+	  centers[3] = -1;
+	  centers[4] = -32768;
+	  centers[5] = 32767;
+	  bad = 0;
+	  for (c = 0; c < 6; c++) {
+	    bad += check_center(&gen, buf.s, buf.n, centers[c], 0, want, got, signals[i].name);
+	    bad += check_center(&gen, buf.s, buf.n, centers[c], 1, want, got, signals[i].name);
+	    sliced += 2 * buf.n;
+	  }
+	  printf("%s: %zu samples, %lu differences\n", signals[i].name, buf.n, bad);
+	  if (bad)
+	    failed = 1;
+	  free(want);
+	  free(got);
+	  free(buf.s);
+	}
+	printf("%s, %lu samples sliced\n", failed ? "FAILED" : "OK", sliced);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
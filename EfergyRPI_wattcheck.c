@@ -0,0 +1,103 @@
+/*---------------------------------------------------------------------
+
+EFERGY READING CHECK
+
+Works out the reading for every ADC value and every exponent byte, the way efergy_watts.h
+does and the way the decoders used to with pow(), and reports every one that differs.
+watts_calc() must give the same double bit for bit, watts_milli() the exact reading
+times 1000, rounded half away from zero.  Exits with 1 if anything differs.
+
+Compile:
+
+gcc -O2 -o EfergyRPI_wattcheck EfergyRPI_wattcheck.c -lm
+
+Example:
+
+./EfergyRPI_wattcheck
+./EfergyRPI_wattcheck 117.5 0.001
+	(more voltages to check besides 1, 110, 120, 230 and 240)
+
+--------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "efergy_watts.h"
+
+#define CHECK_MAX_VOLTAGES	16
+#define CHECK_MAX_REPORTS	10	/* Differences printed per voltage */
+
+// What calculate_watts() did before the table
+double watts_pow(double voltage, unsigned int adc, unsigned char exponent)
+{
+	return (voltage * adc) / ((double) 32768 / (double) pow(2, (signed char) exponent));
+}
+
+// voltage_milli * adc * 2^(exponent - 15), worked out in 128 bits
+int64_t watts_milli_exact(int64_t voltage_milli, unsigned int adc, unsigned char exponent)
+{
+	__int128 v = (__int128) voltage_milli * adc;
+	__int128 half;
+	int shift = (signed char) exponent - 15;
+	int neg = v < 0;
+
+	if (neg)
+		v = -v;
+	if (shift >= 0) {
+		/* v is below 2^64, so it only overflows 128 bits when it is already too large */
+		if (v != 0 && (shift >= 63 || v > ((__int128) INT64_MAX >> shift)))
+			v = INT64_MAX;
+		else
+			v <<= shift;
+	} else if (shift > -127) {
+		half = (__int128) 1 << (-shift - 1);
+		v = (v + half) >> -shift;
+	} else
+		v = 0;
+	return neg ? -(int64_t) v : (int64_t) v;
+}
+
+int main(int argc, char **argv)
+{
+double voltage[CHECK_MAX_VOLTAGES] = { 1, 110, 120, 230, 240 };
+int nvoltage = 5;
+int64_t voltage_milli;
+double a, b;
+int64_t ma, mb;
+unsigned long bad, bad_milli, total = 0;
+unsigned int adc;
+int e, i;
+int failed = 0;
+
+	for (i = 1; i < argc; i++) {
+	  if (nvoltage == CHECK_MAX_VOLTAGES) {
+	    fprintf(stderr, "No more than %d voltages\n", CHECK_MAX_VOLTAGES);
+	    exit(EXIT_FAILURE);
+	  }
+	  voltage[nvoltage++] = strtod(argv[i], NULL);
+	}
+
+	for (i = 0; i < nvoltage; i++) {
+	  voltage_milli = (int64_t) (voltage[i] * 1000 + (voltage[i] < 0 ? -0.5 : 0.5));
+	  bad = bad_milli = 0;
+	  for (e = 0; e < 256; e++)
+	    for (adc = 0; adc < 65536; adc++) {
+	      a = watts_calc(voltage[i], adc, (unsigned char) e);
+	      b = watts_pow(voltage[i], adc, (unsigned char) e);
+	      if (memcmp(&a, &b, sizeof(a)) != 0 && bad++ < CHECK_MAX_REPORTS)
+	        printf("%g V, adc %u, exponent %d: %a, pow() gave %a\n", voltage[i], adc, (signed char) e, a, b);
+	      ma = watts_milli(voltage_milli, adc, (unsigned char) e);
+	      mb = watts_milli_exact(voltage_milli, adc, (unsigned char) e);
+	      if (ma != mb && bad_milli++ < CHECK_MAX_REPORTS)
+	        printf("%g V, adc %u, exponent %d: %lld mW, should be %lld\n", voltage[i], adc, (signed char) e, (long long) ma, (long long) mb);
+	      total++;
+	    }
+	  printf("%g V: %lu of %lu readings differ, %lu in milliwatts\n", voltage[i], bad, 65536UL * 256, bad_milli);
+	  if (bad || bad_milli)
+	    failed = 1;
+	}
+	printf("%s, %lu readings checked\n", failed ? "FAILED" : "OK", total);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
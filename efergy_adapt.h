@@ -0,0 +1,210 @@
+// efergy_adapt.h - Learned bit thresholds
+//
+// A bit is a 0 or a 1 depending on whether its pulse is longer than MINHIGHBIT samples,
+// with pulses of MINLOWBIT samples or less taken as noise.  The right values depend on
+// the transmitter and on the sample rate error of the dongle, which stretches or squeezes
+// every pulse, so they used to be tuned per site.  Instead the pulse lengths of every
+// frame that passes its checksum can be sorted into a short and a long cluster (online
+// two-means, each cluster mean moving 1/2^ADAPT_RATE of the way to each pulse that is
+// nearer to it than to the other one).  MINHIGHBIT then sits halfway between the two, and
+// MINLOWBIT and the preamble length keep their ratio to the short pulses.
+//
+// The means are kept in a small text file so a restart doesn't have to learn them again:
+//
+//	# profile polarity short long
+//	e2 0 5.12 10.57
+//
+// with polarity 1 for the inverted signal and the means in samples.
+//
+// Usage:
+//
+//	struct adapt_table table;
+//	struct pulse_means m;
+//
+//	adapt_load(&table, "/var/lib/efergy/thresholds");	(a missing file is fine)
+//	pulse_means_init(&m, 3, 8);			(MINLOWBIT and MINHIGHBIT of the profile)
+//	adapt_find(&table, "e2", 0, &m);		(carry on from the saved means, if any)
+//	pulse_means_add(&m, pulses, 64);	(pulse lengths of a good frame)
+//	minhighbit = pulse_means_minhighbit(&m);
+//	adapt_set(&table, "e2", 0, &m); adapt_save(&table, "/var/lib/efergy/thresholds");
+//
+#ifndef EFERGY_ADAPT_H
+#define EFERGY_ADAPT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "efergy_profile.h"
+
+#define ADAPT_SHIFT		8	/* Fraction bits of the means */
+#define ADAPT_RATE		4	/* Each pulse moves its cluster 1/16 of the way */
+#define ADAPT_MIN_GAP		(2 << ADAPT_SHIFT)	/* Clusters closer than 2 samples are not trusted */
+#define ADAPT_MAX		(2 * PROFILE_MAX)	/* Profiles times polarities in a file */
+
+struct pulse_means {
+	int32_t shrt;		/* Mean length of the 0 pulses, ADAPT_SHIFT fixed point */
+	int32_t lng;		/* and of the 1 pulses */
+	int32_t shrt0;		/* Where the short mean started, for pulse_means_scale() */
+};
+
+struct adapt_entry {
+	char name[PROFILE_NAME_MAX];
+	int inverted;
+	struct pulse_means means;
+};
+
+struct adapt_table {
+	struct adapt_entry entries[ADAPT_MAX];
+	int count;
+};
+
+// Start from the thresholds of a profile: a short pulse halfway between MINLOWBIT and
+// MINHIGHBIT and a long one as far above MINHIGHBIT, which puts the midpoint right at it.
+static inline void pulse_means_init(struct pulse_means *m, int minlowbit, int minhighbit)
+{
+	m->shrt = ((minlowbit + minhighbit) << ADAPT_SHIFT) / 2;
+	m->lng = (minhighbit << (ADAPT_SHIFT + 1)) - m->shrt;
+	m->shrt0 = m->shrt;
+}
+
+// Learn from the n pulse lengths of a frame that passed its checksum
+static inline void pulse_means_add(struct pulse_means *m, const unsigned char *pulse, int n)
+{
+	int32_t p, mid;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		p = (int32_t) pulse[i] << ADAPT_SHIFT;
+		mid = (m->shrt + m->lng) / 2;
+		if (p <= mid)
+			m->shrt += (p - m->shrt) >> ADAPT_RATE;
+		else
+			m->lng += (p - m->lng) >> ADAPT_RATE;
+	}
+}
+
+// Pulses longer than this are a 1.  -1 while the clusters are too close to tell apart.
+static inline int pulse_means_minhighbit(const struct pulse_means *m)
+{
+	if (m->lng - m->shrt < ADAPT_MIN_GAP)
+		return -1;
+	return (m->shrt + m->lng) >> (ADAPT_SHIFT + 1);
+}
+
+// A length of n samples for the profile, stretched like the short pulses
+static inline int pulse_means_scale(const struct pulse_means *m, int n)
+{
+	if (m->shrt0 <= 0)
+		return n;
+	return (int) (((int64_t) n * m->shrt + m->shrt0 / 2) / m->shrt0);
+}
+
+static inline struct adapt_entry *adapt_entry_find(struct adapt_table *t, const char *name, int inverted)
+{
+	int i;
+
+	for (i = 0; i < t->count; i++)
+		if (t->entries[i].inverted == inverted && strcmp(t->entries[i].name, name) == 0)
+			return &t->entries[i];
+	return NULL;
+}
+
+// Move the means *m (set up for the profile by pulse_means_init()) to the learned ones of
+// the profile and polarity.  Returns -1 if there are none; *m is left alone then.
+static inline int adapt_find(struct adapt_table *t, const char *name, int inverted, struct pulse_means *m)
+{
+	struct adapt_entry *e = adapt_entry_find(t, name, inverted);
+
+	if (e == NULL)
+		return -1;
+	m->shrt = e->means.shrt;
+	m->lng = e->means.lng;
+	return 0;
+}
+
+// Returns -1 if the table is full
+static inline int adapt_set(struct adapt_table *t, const char *name, int inverted, const struct pulse_means *m)
+{
+	struct adapt_entry *e = adapt_entry_find(t, name, inverted);
+
+	if (e == NULL) {
+		if (t->count == ADAPT_MAX)
+			return -1;
+		e = &t->entries[t->count++];
+		snprintf(e->name, sizeof(e->name), "%s", name);
+		e->inverted = inverted;
+	}
+	e->means = *m;
+	return 0;
+}
+
+// Read the means saved by adapt_save().  A file that doesn't exist yet gives an empty
+// table.  Returns -1 if the file can't be read or has errors, which are reported on stderr.
+static inline int adapt_load(struct adapt_table *t, const char *name)
+{
+	struct pulse_means m;
+	char line[256];
+	char pname[PROFILE_NAME_MAX];
+	double shrt, lng;
+	int inverted;
+	int lineno = 0;
+	int errors = 0;
+	FILE *f;
+
+	t->count = 0;
+	f = fopen(name, "r");
+	if (f == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		perror(name);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+		if (sscanf(line, "%31s %d %lf %lf", pname, &inverted, &shrt, &lng) != 4 ||
+				shrt <= 0 || lng <= shrt || lng > 255) {
+			fprintf(stderr, "%s:%d: expected profile polarity short long\n", name, lineno);
+			errors++;
+			continue;
+		}
+		m.shrt = (int32_t) (shrt * (1 << ADAPT_SHIFT) + 0.5);
+		m.lng = (int32_t) (lng * (1 << ADAPT_SHIFT) + 0.5);
+		m.shrt0 = 0;		/* only the means are taken, see adapt_find() */
+		if (adapt_set(t, pname, inverted != 0, &m) < 0) {
+			fprintf(stderr, "%s:%d: too many entries\n", name, lineno);
+			errors++;
+		}
+	}
+	fclose(f);
+	return errors ? -1 : 0;
+}
+
+// Write the table to a temporary file and rename it over name, so a crash never leaves a
+// torn file behind.  Returns -1 on error.
+static inline int adapt_save(const struct adapt_table *t, const char *name)
+{
+	char tmp[4096];
+	FILE *f;
+	int i;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", name) >= (int) sizeof(tmp))
+		return -1;
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "# profile polarity short long\n");
+	for (i = 0; i < t->count; i++)
+		fprintf(f, "%s %d %.2f %.2f\n", t->entries[i].name, t->entries[i].inverted,
+			(double) t->entries[i].means.shrt / (1 << ADAPT_SHIFT),
+			(double) t->entries[i].means.lng / (1 << ADAPT_SHIFT));
+	if (fclose(f) != 0 || rename(tmp, name) < 0) {
+		remove(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+#endif /* EFERGY_ADAPT_H */
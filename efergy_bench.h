@@ -0,0 +1,185 @@
+// efergy_bench.h - Benchmark scenarios, timer and instruction counter
+//
+// The benchmark mode of the logger (-B) runs fixed sample buffers through each stage of
+// the decoder and reports what every stage costs, so changes can be compared commit by
+// commit and it is known how much headroom a slow board has before rtl_fm's pipe backs
+// up.  The buffers are made up by efergy_gen.h with a fixed seed, so every run sees the
+// same samples and decodes the same frames:
+//
+//	quiet		noise only, what the decoder sees most of the time
+//	dense		clean frames back to back
+//	inverted	the same upside down, as rtl_fm hands it over at some tuning offsets
+//	noisy		noisy frames with pulse jitter and a drifting center
+//
+// Instructions are counted with perf_event_open(2) where the kernel lets us (see
+// /proc/sys/kernel/perf_event_paranoid), which is steadier than the time on a busy or
+// frequency scaled machine.  Elsewhere bench_counter_open() fails and the count is left
+// out.
+//
+// Usage:
+//
+//	struct bench_counter ctr;
+//	struct gen_buf buf = { NULL, 0, 0 };
+//	double t;
+//	long long insn;
+//
+//	bench_make(&bench_scenarios[1], profile, 96000, &buf);
+//	bench_counter_open(&ctr);
+//	t = bench_now();
+//	bench_counter_start(&ctr);
+//	... decode buf.s[0 .. buf.n) ...
+//	insn = bench_counter_stop(&ctr);	(-1 without a counter)
+//	t = bench_now() - t;
+//
+#ifndef EFERGY_BENCH_H
+#define EFERGY_BENCH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "efergy_gen.h"
+
+#define BENCH_SEED		20261016	/* Same samples every run */
+
+struct bench_scenario {
+	const char *name;
+	int frames;		/* Frames in the buffer */
+	double seconds;		/* Noise only, when there are no frames */
+	double gap;		/* Seconds of noise ahead of each frame */
+	double noise;		/* During frames */
+	double jitter;		/* Microseconds */
+	double dc;
+	double drift;		/* Per second */
+	int inverted;
+};
+
+static const struct bench_scenario bench_scenarios[] = {
+	{ "quiet", 0, 10.0, 0, 0, 0, 0, 0, 0 },
+	{ "dense", 1000, 0, 0.002, 500, 0, 0, 0, 0 },
+	{ "inverted", 1000, 0, 0.002, 500, 0, 0, 0, 1 },
+	{ "noisy", 1000, 0, 0.01, 2500, 3, -1500, 200, 0 },
+};
+
+#define BENCH_SCENARIOS	((int) (sizeof(bench_scenarios) / sizeof(bench_scenarios[0])))
+
+struct bench_counter {
+	int fd;			/* perf event, -1 if there is none */
+};
+
+static inline double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Samples of scenario s for transmitters of profile prof at rate, appended to b.
+// Returns -1 if out of memory.
+static inline int bench_make(const struct bench_scenario *s, const struct device_profile *prof, long rate, struct gen_buf *b)
+{
+	struct gen_params p;
+	struct gen g;
+	unsigned char bytes[PROFILE_MAX_BYTES];
+	int i;
+
+	gen_params_init(&p);
+	p.rate = rate;
+	p.gap = s->gap;
+	p.noise = s->noise;
+	p.jitter = s->jitter;
+	p.dc = s->dc;
+	p.drift = s->drift;
+	p.inverted = s->inverted;
+	p.seed = BENCH_SEED;
+	gen_init(&g, &p);
+
+	if (s->frames == 0)
+		return gen_gap(&g, b, s->seconds);
+	for (i = 0; i < s->frames; i++) {
+		gen_frame_bytes(prof, 0x0912a4b0 + (i & 3), 100 + 5000 * gen_uniform(&g), bytes);
+		if (gen_frame(&g, b, bytes, prof->bytecount) < 0)
+			return -1;
+	}
+	return gen_gap(&g, b, s->gap);
+}
+
+// Write n samples to fd as rtl_fm does, little endian.  Returns -1 on error.
+static inline int bench_save(int fd, const int16_t *s, size_t n)
+{
+	unsigned char out[8192];
+	size_t i, k;
+
+	while (n > 0) {
+		k = (n > sizeof(out) / 2) ? sizeof(out) / 2 : n;
+		for (i = 0; i < k; i++) {
+			out[2*i] = (unsigned char) s[i];
+			out[2*i+1] = (unsigned char) ((uint16_t) s[i] >> 8);
+		}
+		if (write(fd, out, 2 * k) != (ssize_t) (2 * k))
+			return -1;
+		s += k;
+		n -= k;
+	}
+	return 0;
+}
+
+// Returns -1 if instructions can't be counted here
+static inline int bench_counter_open(struct bench_counter *c)
+{
+#if defined(__linux__) && defined(__NR_perf_event_open)
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	c->fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	c->fd = -1;
+#endif
+	return (c->fd < 0) ? -1 : 0;
+}
+
+static inline void bench_counter_close(struct bench_counter *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+}
+
+static inline void bench_counter_start(struct bench_counter *c)
+{
+#if defined(__linux__)
+	if (c->fd >= 0) {
+		ioctl(c->fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+// Instructions since bench_counter_start(), or -1
+static inline long long bench_counter_stop(struct bench_counter *c)
+{
+	long long count = -1;
+
+#if defined(__linux__)
+	if (c->fd >= 0) {
+		ioctl(c->fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(c->fd, &count, sizeof(count)) != sizeof(count))
+			count = -1;
+	}
+#endif
+	return count;
+}
+
+#endif /* EFERGY_BENCH_H */
@@ -0,0 +1,276 @@
+// efergy_binlog.h - Compact binary log of readings
+//
+// A CSV line costs ~30 bytes and a locale dependent date that is slow to parse back.  The
+// binary log stores each reading as a fixed 16 byte record, grouped into blocks that carry
+// a CRC32, so a month of data can be mmap()ed and walked directly.
+//
+// Layout, all fields little endian:
+//
+//	file header	"EFBL" u16 version, u16 record size, u32 reserved, u32 reserved
+//	block		"EFBK" u16 count, u16 reserved, u32 time of first record, u32 crc32
+//	  record	u32 time, u32 transmitter id, u16 adc, s8 exponent, u8 flags, f32 watts
+//	  ...		(count records)
+//	block		...
+//
+// The CRC covers the first 12 bytes of the block header and the records that follow it.
+// Blocks are appended with a single write(2), so after a crash or power loss at most the
+// last block is torn.  binlog_open() finds the end of the last whole block and cuts off
+// anything after it before appending again.  Readers simply stop at the first block that
+// is short or fails its CRC.
+//
+#ifndef EFERGY_BINLOG_H
+#define EFERGY_BINLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define BINLOG_VERSION		1
+#define BINLOG_HEADER_SIZE	16	/* File header */
+#define BINLOG_BLOCK_SIZE	16	/* Block header */
+#define BINLOG_RECORD_SIZE	16	/* One reading */
+#define BINLOG_BLOCK_MAX	1024	/* Most records in one block */
+
+#define BINLOG_FLAG_CHECKSUM_OK	0x01	/* Frame passed its checksum */
+#define BINLOG_FLAG_CORRECTED	0x02	/* after a bit of it was flipped */
+
+struct binlog_record {
+	uint32_t time;		/* Seconds since the epoch */
+	uint32_t id;		/* Transmitter id, frame bytes 0-3 */
+	uint16_t adc;		/* Raw current ADC value, frame bytes 4-5 */
+	int8_t exponent;	/* Scaling exponent, frame byte 6 */
+	uint8_t flags;		/* BINLOG_FLAG_ bits */
+	float watts;		/* Calculated reading */
+};
+
+static inline uint32_t binlog_crc32(uint32_t crc, const unsigned char *p, size_t len)
+{
+	static uint32_t table[256];
+	uint32_t c;
+	int i, k;
+
+	if (table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static inline void binlog_put16(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void binlog_put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline uint32_t binlog_get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t binlog_get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void binlog_pack(unsigned char *p, const struct binlog_record *rec)
+{
+	uint32_t w;
+
+	memcpy(&w, &rec->watts, 4);
+	binlog_put32(p, rec->time);
+	binlog_put32(p + 4, rec->id);
+	binlog_put16(p + 8, rec->adc);
+	p[10] = (unsigned char) rec->exponent;
+	p[11] = rec->flags;
+	binlog_put32(p + 12, w);
+}
+
+static inline void binlog_unpack(struct binlog_record *rec, const unsigned char *p)
+{
+	uint32_t w = binlog_get32(p + 12);
+
+	rec->time = binlog_get32(p);
+	rec->id = binlog_get32(p + 4);
+	rec->adc = binlog_get16(p + 8);
+	rec->exponent = (int8_t) p[10];
+	rec->flags = p[11];
+	memcpy(&rec->watts, &w, 4);
+}
+
+// Check the block at p (avail bytes left in the file).  Returns the block's total size,
+// or 0 if it is torn or corrupt.
+static inline size_t binlog_block_check(const unsigned char *p, size_t avail)
+{
+	size_t size;
+
+	if (avail < BINLOG_BLOCK_SIZE || memcmp(p, "EFBK", 4) != 0)
+		return 0;
+	size = BINLOG_BLOCK_SIZE + (size_t) binlog_get16(p + 4) * BINLOG_RECORD_SIZE;
+	if (size > avail)
+		return 0;
+	if (binlog_crc32(binlog_crc32(0, p, 12), p + BINLOG_BLOCK_SIZE, size - BINLOG_BLOCK_SIZE) != binlog_get32(p + 12))
+		return 0;
+	return size;
+}
+
+// Open (or create) a binary log for appending.  A torn block left at the end by a crash
+// is cut off.  Returns the file descriptor, or -1 on error or if the file is not a binary
+// log.
+static inline int binlog_open(const char *name)
+{
+	unsigned char hdr[BINLOG_HEADER_SIZE];
+	unsigned char *map;
+	struct stat st;
+	size_t pos, size;
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0)
+		goto fail;
+
+	if (st.st_size < BINLOG_HEADER_SIZE) {
+		/* new (or never finished) file, start it with a header */
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, "EFBL", 4);
+		binlog_put16(hdr + 4, BINLOG_VERSION);
+		binlog_put16(hdr + 6, BINLOG_RECORD_SIZE);
+		if (ftruncate(fd, 0) < 0 || write(fd, hdr, sizeof(hdr)) != sizeof(hdr))
+			goto fail;
+		return fd;
+	}
+
+	map = (unsigned char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	if (memcmp(map, "EFBL", 4) != 0 || binlog_get16(map + 6) != BINLOG_RECORD_SIZE) {
+		munmap(map, st.st_size);
+		goto fail;
+	}
+	pos = BINLOG_HEADER_SIZE;
+	while ((size = binlog_block_check(map + pos, st.st_size - pos)) > 0)
+		pos += size;
+	munmap(map, st.st_size);
+	if (pos < (size_t) st.st_size && ftruncate(fd, pos) < 0)
+		goto fail;
+	return fd;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+// Block being collected in memory before it is appended
+struct binlog_block {
+	unsigned char buf[BINLOG_BLOCK_SIZE + BINLOG_BLOCK_MAX * BINLOG_RECORD_SIZE];
+	int count;
+};
+
+static inline void binlog_block_add(struct binlog_block *b, const struct binlog_record *rec)
+{
+	if (b->count == 0)
+		binlog_put32(b->buf + 8, rec->time);
+	binlog_pack(b->buf + BINLOG_BLOCK_SIZE + b->count * BINLOG_RECORD_SIZE, rec);
+	b->count++;
+}
+
+// Seal the block and return its size in bytes, ready for one write(2).  Resets the block.
+static inline size_t binlog_block_seal(struct binlog_block *b)
+{
+	size_t size = BINLOG_BLOCK_SIZE + (size_t) b->count * BINLOG_RECORD_SIZE;
+
+	if (b->count == 0)
+		return 0;
+	memcpy(b->buf, "EFBK", 4);
+	binlog_put16(b->buf + 4, b->count);
+	binlog_put16(b->buf + 6, 0);
+	binlog_put32(b->buf + 12, binlog_crc32(binlog_crc32(0, b->buf, 12), b->buf + BINLOG_BLOCK_SIZE, size - BINLOG_BLOCK_SIZE));
+	b->count = 0;
+	return size;
+}
+
+// Read only view of a whole log for reporting
+struct binlog_map {
+	const unsigned char *base;
+	size_t size;
+	size_t pos;		/* Offset of the next block */
+	const unsigned char *rec;	/* Next record of the current block */
+	int left;		/* Records left in the current block */
+};
+
+// Returns 0 on success, -1 on error or if the file is not a binary log
+static inline int binlog_map_open(struct binlog_map *m, const char *name)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < BINLOG_HEADER_SIZE) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	m->base = (const unsigned char *) map;
+	m->size = st.st_size;
+	m->pos = BINLOG_HEADER_SIZE;
+	m->rec = NULL;
+	m->left = 0;
+	if (memcmp(m->base, "EFBL", 4) != 0 || binlog_get16(m->base + 6) != BINLOG_RECORD_SIZE) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	return 0;
+}
+
+// Fetch the next record.  Returns 0 at the end of the log or at the first bad block.
+static inline int binlog_map_next(struct binlog_map *m, struct binlog_record *rec)
+{
+	size_t size;
+
+	while (m->left == 0) {
+		size = binlog_block_check(m->base + m->pos, m->size - m->pos);
+		if (size == 0)
+			return 0;
+		m->rec = m->base + m->pos + BINLOG_BLOCK_SIZE;
+		m->left = (size - BINLOG_BLOCK_SIZE) / BINLOG_RECORD_SIZE;
+		m->pos += size;
+	}
+	binlog_unpack(rec, m->rec);
+	m->rec += BINLOG_RECORD_SIZE;
+	m->left--;
+	return 1;
+}
+
+static inline void binlog_map_close(struct binlog_map *m)
+{
+	munmap((void *) m->base, m->size);
+	m->base = NULL;
+}
+
+#endif /* EFERGY_BINLOG_H */
@@ -0,0 +1,1134 @@
+// efergy_decoder.h - Efergy frame decoder
+//
+// Turns rtl_fm samples into Efergy frames.  Everything the decoder knows about a stream
+// lives in struct decoder, nothing in globals, so a program can run as many of them as
+// it needs (EfergyRPI_log -j runs one per chunk of a capture) and embed them in its own
+// loop.  Samples are pushed in with decoder_process() as they arrive, in pieces of any
+// size, and each complete frame is handed to the on_frame callback with the profile it
+// was decoded with, the position of its last sample in the stream and whether a bit was
+// flipped to repair it.  The callback tells the decoder whether the frame was good,
+// usually with frame_checksum_ok(); after a bad one the wave center is resampled.
+//
+// With several profiles, or both polarities, every frame state reads each burst its own
+// way, and all but one read garbage.  So the first good frame claims its burst: the other
+// frame states' frames that started within BURST_SLACK preambles of it are dropped, good
+// or bad.  A frame that fails its checksum is held back until no other frame state is
+// still collecting the same burst, and is only handed to on_frame (and counted, and the
+// center resampled) if none of them decoded it.  With several profiles an 8 bit sum is
+// matched too easily by another profile's frame with a byte of noise added or cut off,
+// and with both polarities by the garbage read from the one the signal doesn't have, so
+// then a good frame also has to have its bits on a steady clock (frame_steady()) and is
+// held until a bit period has gone by without another bit.
+//
+// The options are fields of struct decoder, set between decoder_init() and the first
+// samples (the logger's option in brackets):
+//
+//	track		follow the wave center on the preamble of every good frame instead of
+//			resampling it (-e)
+//	squelch		only decode around bursts (-q)
+//	correct		repair frames one bit short of their checksum (-k)
+//
+// decoder_invert() also decodes the signal upside down (on unless -n), decoder_correlate()
+// finds preambles with the correlator of efergy_preamble.h (-x) and decoder_learn() learns
+// the bit thresholds with efergy_adapt.h (-l).
+//
+// Usage:
+//
+//	int frame_found(void *ctx, const struct device_profile *prof, unsigned char bytes[],
+//			unsigned long long pos, int corrected)
+//	{
+//		if (!frame_checksum_ok(prof, bytes))
+//			return 0;
+//		... bytes[0 .. prof->bytecount) ...
+//		return 1;
+//	}
+//
+//	struct decoder d;
+//
+//	if (decoder_init(&d, profiles, nprofiles, frame_found, ctx) < 0) ...
+//	decoder_invert(&d);
+//	... decoder_process(&d, samples, count) for every piece of the stream ...
+//	decoder_free(&d);
+//
+#ifndef EFERGY_DECODER_H
+#define EFERGY_DECODER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "efergy_profile.h"
+#include "efergy_slicer.h"
+#include "efergy_preamble.h"
+#include "efergy_adapt.h"
+
+#define CENTERSAMP		100	/* Number of samples needed to compute for the wave center */
+#define TRACK_SAMPLES		1024	/* Wave center tracking (-e) updates the slicer every this many samples */
+#define TRACK_SHIFT		2	/* Each preamble moves the center 1/2^TRACK_SHIFT of the way to its middle */
+#define TRACK_EDGE		2	/* Samples at either end of a preamble pulse left out of its level */
+#define TRACK_LEVEL		6	/* Center sits TRACK_LEVEL/16 of the way from the low to the high level */
+#define TRACK_STALE		150000	/* Without a good frame for this many preambles (a minute), failures resample again */
+#define SQUELCH_SAMPLES		512	/* Squelch (-q) decides whether to decode this many samples at a time */
+#define SQUELCH_SMOOTH		3	/* A piece is signal if its sample to sample change is less than 3/4 */
+#define SQUELCH_LEVEL		500	/* of its distance from center and that is at least this on average */
+#define SQUELCH_HANG		1	/* Pieces still decoded after the last one with signal */
+#define CORRELATE_SCORE		12	/* The correlator (-x) takes 12/16 of a clean preamble's score as one */
+#define CORRECT_BITS		4	/* Frame repair (-k) gives up on frames with more ambiguous bits than this */
+#define LEARN_SAVE_FRAMES	100	/* Learned thresholds (-l) are saved at least every this many good frames */
+#define BURST_SLACK		2	/* Frames starting less than this many preambles apart are of one burst */
+#define BURST_STEADY		4	/* Bits of a frame are at most 1/4 of a bit period off its clock */
+
+#define FRAME_HELD_GOOD		1	/* Frame states hold a frame that passed its checksum */
+#define FRAME_HELD_BAD		2	/* or one that didn't */
+
+#define DECODER_MAX_PROFILES	8	/* Most profiles decoded from one stream */
+#define DECODER_HITS		16	/* Correlator hits waiting for the pulse they are in to end */
+#define DECODER_BLOCK		32768	/* Most samples sliced in one go, a block of efergy_reader.h */
+
+// Returns 1 if the frame's checksum matches, or the profile has none
+static inline int frame_checksum_ok(const struct device_profile *prof, const unsigned char bytes[])
+{
+
+unsigned char tbyte;
+int i;
+
+	/* add all captured bytes and mask lower 8 bits */
+
+	tbyte = 0;
+
+	for(i=0;i<prof->bytecount-1;i++)
+		tbyte += bytes[i];
+
+	tbyte &= 0xff;
+
+	return (tbyte == bytes[prof->bytecount-1]) || (prof->checksum == CHECKSUM_NONE);
+}
+
+struct decoder;
+
+// Frame state for one device profile.  Every profile decodes the same pulses, but keeps
+// its own idea of where a frame starts and which bits it has collected so far.
+struct frame_decoder {
+	const struct device_profile *profile;
+	void (*step)(struct decoder *d, struct frame_decoder *f, int hctr, int edge, int hit);	/* Specialized for the profile */
+	int inverted;		/* Decodes the pulses below center */
+	unsigned char pulse[PROFILE_MAX_BYTES * 8 + 8];	/* Samples in the pulse of each bit */
+	unsigned char gap[PROFILE_MAX_BYTES * 8 + 8];	/* Samples from the end of the previous one */
+
+	int minlowbit;		/* Thresholds of frame_step_adaptive(), the profile's until learned */
+	int minhighbit;
+	int preamble_count;
+	struct pulse_means means;	/* Learned pulse lengths (-l) */
+
+	unsigned char bytearray[PROFILE_MAX_BYTES];
+	char bytedata;
+	unsigned long long start;	/* Stream position of the pulse the frame started after */
+	unsigned long long last_bit;	/* and of the end of its latest bit */
+
+	int held;		/* FRAME_HELD_ if a frame waits below for the rest of its burst */
+	int held_corrected;
+	unsigned long long held_start;
+	unsigned long long held_pos;
+	unsigned long long held_until;	/* A good one is taken if no bit follows it before this */
+	unsigned char held_bytes[PROFILE_MAX_BYTES];
+	unsigned char held_pulse[PROFILE_MAX_BYTES * 8 + 8];
+
+	int bitpos;
+	int bytecount;
+	int preamble;
+	int frame;
+	int dbit;
+
+	unsigned long frames_ok;
+	unsigned long frames_bad;	/* Not counting garbage of the polarity the signal doesn't have */
+};
+
+// Decode state for one stream of samples.  The wave center and the runs of samples above
+// and below it are worked out once and shared by the frame decoders of all profiles.
+// The normal decode loop uses a single decoder, the corpus mode (-j) one per chunk of a
+// capture.
+//
+// When the signal comes out of rtl_fm inverted, the pulses that carry the bits are the
+// runs below center.  frames[nframes + i] decodes profile i from those, alongside
+// frames[i] that decodes it from the runs above center.
+struct decoder {
+	struct frame_decoder frames[2 * DECODER_MAX_PROFILES];
+	int nframes;		/* Profiles, frame states of one polarity */
+	int invert;		/* Also decode the inverted signal */
+	int polarity;		/* 0 or nframes for the polarity of the last good frame, -1 before it */
+	int failed;		/* A burst none of the frame states could decode */
+	unsigned long long failed_pos;	/* and where the first of their frames of it ended */
+	int nheld;		/* Frame states holding a frame */
+	int guard;		/* More than the checksum to a good frame, for several profiles or polarities */
+	int claimed;		/* A good frame has claimed the burst starting at claim_start */
+	unsigned long long claim_start;
+	unsigned long long burst;	/* Frames starting at most this many samples apart are of one burst */
+	void (*block)(struct decoder *d, const int16_t *buf, size_t count);	/* Loop specialized for the profile(s) */
+
+	int hctr;
+	int dcenter;
+
+	long center;
+	int track;		/* Follow the wave center continuously instead of resampling it */
+	int track_preamble;	/* Shortest preamble of the profiles */
+	long long center_fix;	/* Tracked center, fixed point with TRACK_SHIFT fraction bits */
+	int track_pending;	/* track_level was measured on the preamble ending at track_pos */
+	long track_level;	/* and is taken if the frame after it is good */
+	unsigned long long track_pos;
+	unsigned long long track_good;	/* Stream position of the last good frame */
+	unsigned long long track_stale;	/* Samples without a good frame before a failure resamples the center */
+	unsigned long bursts;	/* Good frames the center was tracked on */
+
+	int squelch;		/* Only decode around bursts */
+	int awake;		/* Decoding, not skipping */
+	int hang;		/* Pieces to go before going back to sleep */
+	int16_t tail[SQUELCH_SAMPLES];	/* End of the previous block, if it was skipped */
+	size_t tail_len;
+	unsigned long long decoded;	/* Samples that were not skipped */
+
+	int correlate;		/* Find preambles with the correlator, see decoder_correlate() */
+	struct preamble_corr corr;
+	struct preamble_hit hits[DECODER_HITS];	/* Correlator hits not yet matched to a pulse */
+	int nhits;
+	unsigned long preambles;	/* Pulses that started a frame because of a hit */
+	unsigned long long score;	/* Sum of their scores */
+
+	int correct;		/* Repair frames one bit short of their checksum */
+	unsigned long corrected;	/* Frames repaired */
+
+	int learn;		/* Learn the bit thresholds, see decoder_learn() */
+	unsigned long learned;	/* Frames learned from since learn_dirty was cleared */
+	int learn_dirty;	/* The thresholds moved, or LEARN_SAVE_FRAMES frames were learned from */
+
+	struct slicer slicer;
+	struct slicer_run *runs;	/* Room for DECODER_BLOCK runs */
+	long run_start;		/* Block index of the first sample of the slicer's run in progress */
+
+	unsigned long long samples;	/* Samples decoded so far */
+	unsigned long frames_ok;
+	unsigned long frames_bad;
+
+	// Called with each complete frame, the profile it was decoded with, the position of its
+	// last sample and whether a bit was flipped to pass the checksum.  Returns 0 on a
+	// checksum mismatch.
+	int (*on_frame)(void *ctx, const struct device_profile *prof, unsigned char bytes[], unsigned long long pos, int corrected);
+	void *ctx;
+};
+
+static inline void frame_decoder_reset(struct frame_decoder *f)
+{
+	f->bytedata = 0;
+	f->bytecount = 0;
+	f->bitpos = 0;
+	f->dbit = 0;
+	f->preamble = 0;
+	f->frame = 0;
+}
+
+// Samples between a pulse and the logic 1 threshold
+static inline int frame_margin(int pulse, int minhighbit)
+{
+	return (pulse > minhighbit) ? pulse - minhighbit - 1 : minhighbit - pulse;
+}
+
+// Frame repair (-k).  Only the ambiguous bits are tried, those whose pulse was a single
+// sample from reading the other way, and only while there are at most CORRECT_BITS of
+// them: every flip tried is another chance for an 8 bit sum to match a frame of noise.
+// Each is flipped in turn.  If exactly one of them makes the checksum match, it is left
+// flipped and returned, otherwise -1 is.  Two that do would be a guess.
+// A repaired frame still has to pass frame_steady().
+static inline int frame_correct(struct frame_decoder *f, int nbits, int minhighbit)
+{
+	int cand[CORRECT_BITS];
+	int ncand = 0;
+	int found = -1;
+	int i, k;
+
+	for (i = 0; i < nbits; i++) {
+		if (frame_margin(f->pulse[i], minhighbit) > 0)
+			continue;
+		if (ncand == CORRECT_BITS)
+			return -1;	/* too noisy to guess */
+		cand[ncand++] = i;
+	}
+
+	for (k = 0; k < ncand; k++) {
+		f->bytearray[cand[k] / 8] ^= 0x80 >> (cand[k] % 8);
+		if (frame_checksum_ok(f->profile, f->bytearray)) {
+			if (found >= 0) {
+				f->bytearray[cand[k] / 8] ^= 0x80 >> (cand[k] % 8);
+				return -1;
+			}
+			found = cand[k];
+		}
+		f->bytearray[cand[k] / 8] ^= 0x80 >> (cand[k] % 8);
+	}
+	if (found >= 0)
+		f->bytearray[found / 8] ^= 0x80 >> (found % 8);
+	return found;
+}
+
+// Set the thresholds of frame_step_adaptive() from the learned means.  Returns 1 if they
+// moved.
+static inline int frame_thresholds(struct frame_decoder *f)
+{
+	const struct device_profile *p = f->profile;
+	int minlowbit = p->minlowbit;
+	int minhighbit = pulse_means_minhighbit(&f->means);
+	int preamble_count = p->preamble;
+	int moved;
+
+	if (minhighbit < 0)
+		minhighbit = p->minhighbit;	/* nothing to go by yet */
+	else {
+		minlowbit = pulse_means_scale(&f->means, p->minlowbit);
+		preamble_count = pulse_means_scale(&f->means, p->preamble);
+		if (preamble_count > p->preamble)
+			preamble_count = p->preamble;	/* a stretched preamble is long enough anyway */
+	}
+	if (minlowbit >= minhighbit)
+		minlowbit = minhighbit - 1;
+	moved = (minlowbit != f->minlowbit || minhighbit != f->minhighbit || preamble_count != f->preamble_count);
+	f->minlowbit = minlowbit;
+	f->minhighbit = minhighbit;
+	f->preamble_count = preamble_count;
+	return moved;
+}
+
+// Learn the bit thresholds (-l) from the nbits pulses of a frame
+static inline void frame_learn(struct decoder *d, struct frame_decoder *f, const unsigned char pulse[], int nbits)
+{
+	pulse_means_add(&f->means, pulse, nbits);
+	if (frame_thresholds(f) || ++d->learned >= LEARN_SAVE_FRAMES)
+		d->learn_dirty = 1;
+}
+
+// Frames starting at stream positions a and b are of the same burst
+static inline int decoder_same_burst(const struct decoder *d, unsigned long long a, unsigned long long b)
+{
+	return ((a > b) ? a - b : b - a) <= d->burst;
+}
+
+// Count a failed frame of frame state f that ended at stream position pos.  Once a
+// polarity has a good frame, the other one only decodes garbage and its failures don't
+// count, for the frame state either, so the frame states add up to the decoder.
+static inline void decoder_failed(struct decoder *d, struct frame_decoder *f, unsigned long long pos)
+{
+	if (d->polarity < 0 || d->polarity == (f->inverted ? d->nframes : 0)) {
+		f->frames_bad++;
+		d->frames_bad++;
+		if (!d->failed || pos < d->failed_pos)
+			d->failed_pos = pos;
+		d->failed = 1;
+	}
+}
+
+// The bits of a real frame come on a steady clock, so the ends of their pulses are evenly
+// spaced.  Returns the bit period in samples, or 0 if any of the nbits bits is more than
+// 1/BURST_STEADY of a period off it, as bits made up of noise around a burst are.
+static inline unsigned int frame_steady(const struct frame_decoder *f, int nbits)
+{
+	unsigned int sum = 0;
+	int i;
+
+	for (i = 1; i < nbits; i++)
+		sum += f->gap[i];
+	for (i = 1; i < nbits; i++)
+		if ((unsigned int) abs((int) (f->gap[i] * (nbits - 1)) - (int) sum) * BURST_STEADY > sum)
+			return 0;
+	return sum / (nbits - 1);
+}
+
+// A good frame of f claims its burst, the failed frames held for it are dropped
+static inline void decoder_claim(struct decoder *d, struct frame_decoder *f, unsigned long long start)
+{
+	struct frame_decoder *g;
+	int i;
+
+	d->claimed = 1;
+	d->claim_start = start;
+	for (i = 0; (i < 2 * d->nframes) && (d->nheld > 0); i++) {
+		g = &d->frames[i];
+		if (g != f && g->held == FRAME_HELD_BAD && decoder_same_burst(d, g->held_start, start)) {
+			g->held = 0;
+			d->nheld--;
+		}
+	}
+}
+
+// Wave center tracking (-e).  A good frame that started at stream position start moves the
+// tracked center part of the way to the level measured on its preamble, see
+// decoder_track_burst().
+static inline void decoder_track_frame(struct decoder *d, unsigned long long start, unsigned long long pos)
+{
+	d->track_good = pos;
+	if (!d->track_pending || !decoder_same_burst(d, d->track_pos, start))
+		return;
+	d->center_fix += ((long long) d->track_level * (1 << TRACK_SHIFT) - d->center_fix) >> TRACK_SHIFT;
+	d->track_pending = 0;
+	d->bursts++;
+}
+
+// Hand a good frame of f to on_frame
+static inline void decoder_accept(struct decoder *d, struct frame_decoder *f, unsigned char bytes[],
+		const unsigned char pulse[], unsigned long long start, unsigned long long pos, int corrected)
+{
+	int nbits = f->profile->bytecount * 8;
+
+	if (d->on_frame(d->ctx, f->profile, bytes, pos, corrected) == 0)
+	{
+		decoder_failed(d, f, pos);
+		return;
+	}
+	f->frames_ok++;
+	d->frames_ok++;
+	d->failed = 0;
+	if (corrected) {
+		/* a frame that needed repair says as much about the center as a failed one */
+		d->corrected++;
+		d->failed = 1;
+		d->failed_pos = pos;
+	}
+	d->polarity = f->inverted ? d->nframes : 0;
+	decoder_claim(d, f, start);
+	if (d->track)
+		decoder_track_frame(d, start, pos);
+	if (d->learn && !corrected)
+		frame_learn(d, f, pulse, nbits);
+}
+
+// Give up on the failed frame held by f.  It is reported unless it is of the polarity the
+// signal doesn't have.
+static inline void decoder_reject(struct decoder *d, struct frame_decoder *f)
+{
+	f->held = 0;
+	d->nheld--;
+	if (f->inverted == (d->polarity > 0))
+		d->on_frame(d->ctx, f->profile, f->held_bytes, f->held_pos, 0);
+	decoder_failed(d, f, f->held_pos);
+}
+
+// Settle the held frames at stream position now, or all of them.  A good frame is taken
+// once a bit period has gone by without another bit.  A failed frame is given up on once
+// no other frame state is still collecting its burst or waiting with a good frame of it.
+static inline void decoder_release(struct decoder *d, unsigned long long now, int all)
+{
+	struct frame_decoder *f, *g;
+	int i, k;
+
+	for (i = 0; (i < 2 * d->nframes) && (d->nheld > 0); i++) {
+		f = &d->frames[i];
+		if (f->held == FRAME_HELD_GOOD && (all || now > f->held_until)) {
+			f->held = 0;
+			d->nheld--;
+			decoder_accept(d, f, f->held_bytes, f->held_pulse, f->held_start, f->held_pos, f->held_corrected);
+		}
+	}
+	for (i = 0; (i < 2 * d->nframes) && (d->nheld > 0); i++) {
+		f = &d->frames[i];
+		if (f->held != FRAME_HELD_BAD)
+			continue;
+		for (k = 0; !all && (k < 2 * d->nframes); k++) {
+			g = &d->frames[k];
+			if (k != i && ((g->frame && decoder_same_burst(d, g->start, f->held_start)) ||
+					(g->held == FRAME_HELD_GOOD && decoder_same_burst(d, g->held_start, f->held_start))))
+				break;
+		}
+		if (all || k == 2 * d->nframes)
+			decoder_reject(d, f);
+	}
+}
+
+// Keep the frame f just collected until the rest of its burst has been seen, see
+// decoder_release()
+static inline void frame_hold(struct decoder *d, struct frame_decoder *f, int held, int nbits, int corrected,
+		unsigned int period)
+{
+	if (f->held == FRAME_HELD_BAD)
+		decoder_reject(d, f);	/* still waiting for its burst, that has been long enough */
+	else if (f->held == FRAME_HELD_GOOD) {
+		f->held = 0;
+		d->nheld--;
+		decoder_accept(d, f, f->held_bytes, f->held_pulse, f->held_start, f->held_pos, f->held_corrected);
+	}
+	memcpy(f->held_bytes, f->bytearray, nbits / 8);
+	memcpy(f->held_pulse, f->pulse, nbits);
+	f->held_start = f->start;
+	f->held_pos = d->samples + d->run_start;
+	f->held_until = f->last_bit + period + period / BURST_STEADY;
+	f->held_corrected = corrected;
+	f->held = held;
+	d->nheld++;
+}
+
+// Feed one positive pulse of hctr samples to a frame decoder.  edge is set if the pulse
+// ended on a negative edge, hit if the correlator found the end of a preamble in it.
+// Always inlined, so for the built in profiles the compiler sees the thresholds as
+// constants.
+static inline __attribute__((always_inline))
+void frame_step(struct decoder *d, struct frame_decoder *f, int hctr, int edge, int hit,
+		const int minlowbit, const int minhighbit, const int preamble_count, const int bytecount)
+{
+unsigned long long pos;
+unsigned int period;
+int ok;
+int corrected;
+int bit;
+
+	if (f->held == FRAME_HELD_GOOD && edge && hctr > minlowbit)
+	{
+		/* another bit on the heels of the frame, it was the start of a longer one */
+		f->held = 0;
+		d->nheld--;
+	}
+
+	if (hctr > preamble_count)	
+		f->preamble = 1;
+
+	if (hit)
+	{
+		/* whatever came before, a frame starts after this pulse */
+		frame_decoder_reset(f);
+		f->preamble = 1;
+	}
+
+	if (edge)
+	{
+		/* at negative edge */
+
+		if ((hctr > minlowbit) && (f->frame == 1))
+		{
+			f->dbit++;
+			f->bitpos++;	
+			f->bytedata = f->bytedata << 1;
+			if (hctr > minhighbit)
+				f->bytedata = f->bytedata | 0x1;
+			f->pulse[f->bytecount * 8 + f->bitpos - 1] = (hctr > 255) ? 255 : hctr;
+			pos = d->samples + d->run_start;
+			f->gap[f->bytecount * 8 + f->bitpos - 1] = (pos - f->last_bit > 255) ? 255 : pos - f->last_bit;
+			f->last_bit = pos;
+
+			if (f->bitpos > 7)
+			{
+				f->bytearray[f->bytecount] = f->bytedata;
+				f->bytedata = 0;
+				f->bitpos = 0;
+
+				f->bytecount++;
+
+				if (f->bytecount == bytecount)
+				{
+					/* another frame state has decoded this burst already, whatever this
+					   one made of it is garbage */
+
+					if (d->claimed && decoder_same_burst(d, f->start, d->claim_start))
+					{
+						frame_decoder_reset(f);
+						return;
+					}
+
+					/* at this point check for checksum and calculate watt data */
+
+					ok = frame_checksum_ok(f->profile, f->bytearray);
+					bit = -1;
+					if (!ok && d->correct && f->inverted == (d->polarity > 0))
+						bit = frame_correct(f, bytecount * 8, minhighbit);
+					corrected = (bit >= 0);
+					ok = ok || corrected;
+
+					/* with several profiles an 8 bit sum is too easily matched by a frame
+					   of another profile, or by one read upside down: the bits have to be
+					   on a steady clock, and the burst has to end with them.  So does a
+					   repaired frame, since every flip tried is another chance for the
+					   sum to match. */
+
+					period = 0;
+					if (ok && (d->guard || corrected))
+						period = frame_steady(f, bytecount * 8);
+					if (corrected && period == 0)
+					{
+						/* the repair was a guess, it is a failed frame after all */
+						f->bytearray[bit / 8] ^= 0x80 >> (bit % 8);
+						ok = corrected = 0;
+					}
+
+					if (ok && d->guard && period == 0)
+						;	/* the checksum matched by chance */
+					else if (!ok)
+						frame_hold(d, f, FRAME_HELD_BAD, bytecount * 8, 0, 0);
+					else if (d->guard || corrected)
+						frame_hold(d, f, FRAME_HELD_GOOD, bytecount * 8, corrected, period);
+					else
+						decoder_accept(d, f, f->bytearray, f->pulse, f->start, d->samples + d->run_start, corrected);
+
+					/* done, the next pulse may be the next frame's preamble already */
+					frame_decoder_reset(f);
+				}
+			}
+			
+			if (f->dbit > bytecount*8)	/* all bits of the frame, not including preamble */
+			{	
+				/* reset frame variables */
+
+				frame_decoder_reset(f);
+			}
+		}
+	} 
+
+	if (f->preamble == 1)
+	{
+		/* end of preamble, start of frame data */
+		f->preamble = 0;
+		if (!f->frame) {
+			f->start = d->samples + d->run_start;
+			f->last_bit = f->start;
+		}
+		f->frame = 1;
+	}
+}
+
+static inline void frame_step_e2(struct decoder *d, struct frame_decoder *f, int hctr, int edge, int hit)
+{
+	frame_step(d, f, hctr, edge, hit, E2_MINLOWBIT, E2_MINHIGHBIT, E2_PREAMBLE_COUNT, E2_BYTECOUNT);
+}
+
+static inline void frame_step_elite(struct decoder *d, struct frame_decoder *f, int hctr, int edge, int hit)
+{
+	frame_step(d, f, hctr, edge, hit, ELITE_MINLOWBIT, ELITE_MINHIGHBIT, ELITE_PREAMBLE_COUNT, ELITE_BYTECOUNT);
+}
+
+static inline void frame_step_generic(struct decoder *d, struct frame_decoder *f, int hctr, int edge, int hit)
+{
+	const struct device_profile *p = f->profile;
+
+	frame_step(d, f, hctr, edge, hit, p->minlowbit, p->minhighbit, p->preamble, p->bytecount);
+}
+
+static inline void frame_step_adaptive(struct decoder *d, struct frame_decoder *f, int hctr, int edge, int hit)
+{
+	const struct device_profile *p = f->profile;
+
+	frame_step(d, f, hctr, edge, hit, f->minlowbit, f->minhighbit, f->preamble_count, p->bytecount);
+}
+
+// Average of buf[from, to) without TRACK_EDGE samples at either end, or 0 samples if
+// there is too little left
+static inline long decoder_level(const int16_t *buf, long from, long to, long *count)
+{
+	long long sum = 0;
+	long i;
+
+	from += TRACK_EDGE;
+	to -= TRACK_EDGE;
+	*count = to - from;
+	if (*count < 4)
+		return 0;
+	for (i = from; i < to; i++)
+		sum += buf[i];
+	return (long) (sum / *count);
+}
+
+// Wave center tracking (-e).  The center that matters sits between the two FSK levels of
+// a burst, not at the average of the noise around it, so each preamble is used to
+// measure them: the long low run in front of it and its high run.  The center is put a
+// bit below the middle (TRACK_LEVEL), since a noise spike that splits a high pulse loses
+// the frame while a short spike above center inside a low run is ignored.  A long pulse
+// in the noise looks just like a preamble, so the measurement is only taken once the frame
+// after it has passed its checksum (and the guard), by decoder_track_frame().  The tracked
+// center moves part of the way to every measurement taken, an exponential moving average
+// that follows the drift of a dongle as it warms up.  The slicer picks up the new center
+// at its next TRACK_SAMPLES piece, so there is never a pause to resample.
+//
+// Until the first good frame, and once there has been none for TRACK_STALE preambles'
+// worth of samples, a failure resamples the center as without tracking, so a center that
+// is too far off to decode anything doesn't stay that way.
+static inline void decoder_track_burst(struct decoder *d, const int16_t *buf, long lo_from, long hi_from, long hi_to)
+{
+	long hi, lo, nhi, nlo;
+
+	if (lo_from < 0)
+		return;		/* the low run started in an earlier block */
+	lo = decoder_level(buf, lo_from, hi_from, &nlo);
+	hi = decoder_level(buf, hi_from, hi_to, &nhi);
+	if (nlo == 0 || nhi == 0 || hi <= lo)
+		return;
+	d->track_level = lo + (hi - lo) * TRACK_LEVEL / 16;
+	d->track_pos = d->samples + hi_to;
+	d->track_pending = 1;
+}
+
+// Correlator (-x) hits are kept until the slicer has ended the pulse they are in.
+// Returns the best score of the hits in samples [from, to] of the stream, or 0 if there
+// are none, and drops them and any older ones.
+static inline int decoder_hit(struct decoder *d, unsigned long long from, unsigned long long to)
+{
+	int i = 0;
+	int hit = 0;
+
+	while (i < d->nhits && d->hits[i].pos <= to) {
+		if (d->hits[i].pos >= from && d->hits[i].score > hit)
+			hit = d->hits[i].score;
+		i++;
+	}
+	if (i > 0) {
+		d->nhits -= i;
+		memmove(d->hits, d->hits + i, d->nhits * sizeof(d->hits[0]));
+	}
+	return hit;
+}
+
+static inline void decoder_correlate_piece(struct decoder *d, const int16_t *buf, size_t n, size_t len)
+{
+	struct preamble_hit hits[DECODER_HITS];
+	size_t nhits, k;
+
+	nhits = preamble_corr_process(&d->corr, buf + n, len, d->slicer.center, d->samples + n, hits, DECODER_HITS);
+	for (k = 0; k < nhits; k++) {
+		if (d->nhits == DECODER_HITS)
+			decoder_hit(d, 0, d->hits[0].pos);	/* drop the oldest */
+		d->hits[d->nhits++] = hits[k];
+	}
+}
+
+// The decode loop.  With a single profile (single != 0) its frame_step() is inlined with
+// the thresholds given here, otherwise every profile's specialized step is called for
+// each pulse.
+static inline __attribute__((always_inline))
+void decoder_loop(struct decoder *d, const int16_t *buf, size_t count, const int single,
+		const int minlowbit, const int minhighbit, const int preamble_count, const int bytecount)
+{
+size_t n;
+size_t len;
+size_t nruns;
+size_t r;
+int next;
+int edge;
+int pol;
+int hit;
+int i;
+
+	n = 0;
+	while (n < count)
+	{
+		/* initially capture CENTERSAMP samples for wave center computation */
+		
+		if (d->dcenter > 0)
+		{
+			for (; (n < count) && (d->dcenter > 0); n++)
+			{
+				d->dcenter--;
+				d->center = d->center + buf[n];	/* Accumulate FSK wave data */ 
+			}
+
+			if (d->dcenter == 0)
+			{
+				/* compute for wave center and re-initialize frame variables */
+
+				d->center = (long) (d->center/CENTERSAMP);
+				d->center_fix = (long long) d->center << TRACK_SHIFT;
+
+				d->hctr  = 0;
+				decoder_release(d, 0, 1);
+				for (i = 0; i < 2 * d->nframes; i++)
+					frame_decoder_reset(&d->frames[i]);
+				d->failed = 0;
+
+				/* the last center sample is the "previous sample" of the first run */
+				slicer_init(&d->slicer, d->center, &buf[n-1]);
+				d->run_start = n - 1;
+				if (d->correlate) {
+					preamble_corr_reset(&d->corr);
+					d->nhits = 0;
+				}
+			}
+			continue;
+		}
+
+		/* split the rest of the block into runs of samples above/at/below center, a
+		   piece at a time when the center is tracked */
+
+		len = count - n;
+		if (d->track && len > TRACK_SAMPLES)
+			len = TRACK_SAMPLES;
+		if (d->correlate)
+			decoder_correlate_piece(d, buf, n, len);
+		nruns = slicer_process(&d->slicer, buf + n, len, d->runs);
+
+		for (r = 0; (r < nruns) && (d->dcenter == 0); r++)
+		{
+			d->run_start += d->runs[r].len;	/* now the index of the sample that ended this run */
+
+			if (d->nheld > 0)
+				decoder_release(d, d->samples + d->run_start, 0);
+
+			/* pulses above center, or below it for the frame states of the inverted signal */
+
+			if (d->runs[r].sign == SLICE_HIGH)
+				pol = 0;
+			else if (d->runs[r].sign == SLICE_LOW && d->invert)
+				pol = d->nframes;
+			else
+				continue;
+
+			/* count samples at high logic */
+
+			d->hctr = d->runs[r].len - 1;
+			next = (r+1 < nruns) ? d->runs[r+1].sign : d->slicer.sign;
+			edge = (next == (pol ? SLICE_HIGH : SLICE_LOW));
+
+			if (d->track && !pol && d->hctr > d->track_preamble && r > 0 && d->runs[r-1].sign == SLICE_LOW)
+				decoder_track_burst(d, buf, d->run_start - (long) d->runs[r].len - (long) d->runs[r-1].len,
+					d->run_start - (long) d->runs[r].len, d->run_start);
+
+			hit = 0;
+			if (d->correlate && !pol && d->nhits > 0) {
+				hit = decoder_hit(d, d->samples + d->run_start - d->runs[r].len, d->samples + d->run_start - 1);
+				if (hit) {
+					d->preambles++;
+					d->score += hit;
+				}
+			}
+
+			for (i = 0; i < (single ? 1 : d->nframes); i++)
+			{
+				if (single)
+					frame_step(d, &d->frames[pol], d->hctr, edge, hit,
+						minlowbit, minhighbit, preamble_count, bytecount);
+				else
+					d->frames[pol + i].step(d, &d->frames[pol + i], d->hctr, edge, hit);
+			}
+			if (d->nheld > 0)
+				decoder_release(d, d->samples + d->run_start, 0);
+
+			/* if no profile could decode the last burst (in either polarity while it isn't
+			   known which one the signal has), compute for a new wave center (unless it is
+			   tracked anyway, and the tracker has had a good frame lately) */
+
+			if (d->failed) {
+				if (!d->track || d->bursts == 0 || d->samples + d->run_start - d->track_good > d->track_stale)
+					d->dcenter = CENTERSAMP;	/* make dcenter non-zero to trigger center resampling */
+				else
+					d->failed = 0;
+			}
+
+			d->hctr = 0;
+		}
+
+		if (d->dcenter > 0)	/* resample the center starting right after the failed frame */
+			n = (d->failed_pos >= d->samples) ? d->failed_pos - d->samples + 1 : 0;
+		else {
+			n += len;
+			if (d->track) {
+				d->center = (long) (d->center_fix >> TRACK_SHIFT);
+				d->slicer.center = (int) d->center;
+			}
+		}
+
+	} /* while n */
+
+	d->run_start -= count;
+	d->samples += count;
+}
+
+static inline void decoder_block_e2(struct decoder *d, const int16_t *buf, size_t count)
+{
+	decoder_loop(d, buf, count, 1, E2_MINLOWBIT, E2_MINHIGHBIT, E2_PREAMBLE_COUNT, E2_BYTECOUNT);
+}
+
+static inline void decoder_block_elite(struct decoder *d, const int16_t *buf, size_t count)
+{
+	decoder_loop(d, buf, count, 1, ELITE_MINLOWBIT, ELITE_MINHIGHBIT, ELITE_PREAMBLE_COUNT, ELITE_BYTECOUNT);
+}
+
+static inline void decoder_block_multi(struct decoder *d, const int16_t *buf, size_t count)
+{
+	decoder_loop(d, buf, count, 0, 0, 0, 0, 0);
+}
+
+// Squelch (-q).  An Efergy transmitter sends a burst of ~10 ms every 6 to 10 seconds, the
+// rest is noise that is not worth slicing.  FSK stays on one level for several samples
+// at a time while noise jumps about from sample to sample, so a piece of
+// SQUELCH_SAMPLES counts as signal when the sum of its sample to sample changes is small
+// next to the sum of its distances from center.  Both sums vectorize well and cost less
+// than slicing the noise.
+static inline int squelch_signal(const int16_t *buf, size_t len, int center)
+{
+	uint32_t change = 0;
+	uint32_t level = 0;
+	size_t i;
+
+	for (i = 1; i < len; i++) {
+		change += abs(buf[i] - buf[i-1]);
+		level += abs(buf[i] - center);
+	}
+	return (level >= SQUELCH_LEVEL * (uint32_t) len) && ((uint64_t) change * 4 < (uint64_t) level * SQUELCH_SMOOTH);
+}
+
+// Pass samples on to the decode loop after skipping some.  The pulse in progress and any
+// frame collected so far are dropped.
+static inline void decoder_wake(struct decoder *d)
+{
+	int i;
+
+	d->slicer.len = 0;
+	d->slicer.sign = SLICE_MID;
+	d->run_start = 0;
+	d->hctr = 0;
+	decoder_release(d, 0, 1);
+	for (i = 0; i < 2 * d->nframes; i++)
+		frame_decoder_reset(&d->frames[i]);
+	d->failed = 0;
+	d->awake = 1;
+	if (d->correlate) {
+		preamble_corr_reset(&d->corr);
+		d->nhits = 0;
+	}
+}
+
+// count samples were lost between the ones decoded so far and the next block, e.g. dropped
+// by a reader that fell behind (efergy_pipeline.h).  The pulse and frames in progress are
+// dropped and the frame states look for a preamble again, so no frame is decoded from
+// samples joined across the gap.
+static inline void decoder_skip(struct decoder *d, unsigned long long count)
+{
+	d->samples += count;
+	d->tail_len = 0;
+	if (d->dcenter == 0 && (d->awake || !d->squelch))
+		decoder_wake(d);
+}
+
+static inline void decoder_span(struct decoder *d, const int16_t *buf, size_t count)
+{
+	if (count > 0) {
+		d->block(d, buf, count);
+		d->decoded += count;
+	}
+}
+
+// Squelched decode of a block.  The piece in front of the first one with signal is
+// decoded too, so the preamble isn't cut, even when it is the end of the previous block.
+static inline void decoder_block_squelch(struct decoder *d, const int16_t *buf, size_t count)
+{
+	size_t n, len;
+	size_t from = 0;	/* First sample not yet decoded or skipped */
+	size_t start;
+	int center = (d->dcenter > 0) ? 0 : (int) d->center;
+
+	for (n = 0; n < count; n += len) {
+		len = (count - n > SQUELCH_SAMPLES) ? SQUELCH_SAMPLES : count - n;
+		if (squelch_signal(buf + n, len, center)) {
+			if (!d->awake) {
+				start = (n >= from + SQUELCH_SAMPLES) ? n - SQUELCH_SAMPLES : from;
+				d->samples += start - from;	/* skipped */
+				decoder_wake(d);
+				if (start == 0 && d->tail_len > 0) {
+					/* look back into the previous block */
+					d->samples -= d->tail_len;
+					decoder_span(d, d->tail, d->tail_len);
+				}
+				from = start;
+			}
+			d->hang = SQUELCH_HANG;
+		} else if (d->awake && d->hang-- == 0) {
+			decoder_span(d, buf + from, n - from);
+			from = n;
+			d->awake = 0;
+		}
+	}
+
+	if (d->awake) {
+		decoder_span(d, buf + from, count - from);
+		d->tail_len = 0;
+	} else {
+		d->samples += count - from;	/* skipped */
+		d->tail_len = (count - from > SQUELCH_SAMPLES) ? SQUELCH_SAMPLES : count - from;
+		memcpy(d->tail, buf + count - d->tail_len, d->tail_len * sizeof(int16_t));
+	}
+}
+
+// Decode count (at most DECODER_BLOCK) samples that follow the ones decoded so far
+static inline void decoder_block(struct decoder *d, const int16_t *buf, size_t count)
+{
+	if (d->squelch)
+		decoder_block_squelch(d, buf, count);
+	else
+		decoder_span(d, buf, count);
+}
+
+// Decode the stream for nprofiles device profiles at once.  Each profile uses the
+// specialized code of the built in profile with the same thresholds, if any.
+static inline int decoder_init(struct decoder *d, struct device_profile *const profiles[], int nprofiles,
+		int (*on_frame)(void *ctx, const struct device_profile *prof, unsigned char bytes[], unsigned long long pos, int corrected), void *ctx)
+{
+	static void (*const builtin_block[])(struct decoder *d, const int16_t *buf, size_t count) = {
+		decoder_block_e2,
+		decoder_block_elite,
+	};
+	static void (*const builtin_step[])(struct decoder *d, struct frame_decoder *f, int hctr, int edge, int hit) = {
+		frame_step_e2,
+		frame_step_elite,
+	};
+	const struct device_profile *prof;
+	const struct device_profile *b;
+	int i, k;
+
+	if (nprofiles < 1 || nprofiles > DECODER_MAX_PROFILES)
+		return -1;
+	d->nframes = nprofiles;
+	d->block = decoder_block_multi;
+	for (i = 0; i < nprofiles; i++) {
+		prof = profiles[i];
+		memset(&d->frames[i], 0, sizeof(d->frames[i]));
+		d->frames[i].profile = prof;
+		d->frames[i].step = frame_step_generic;
+		d->frames[i].minlowbit = prof->minlowbit;
+		d->frames[i].minhighbit = prof->minhighbit;
+		d->frames[i].preamble_count = prof->preamble;
+		for (k = 0; k < PROFILE_BUILTIN_COUNT; k++) {
+			b = &profile_builtin[k];
+			if (prof->minlowbit == b->minlowbit && prof->minhighbit == b->minhighbit &&
+					prof->preamble == b->preamble && prof->bytecount == b->bytecount) {
+				d->frames[i].step = builtin_step[k];
+				if (nprofiles == 1)
+					d->block = builtin_block[k];
+				break;
+			}
+		}
+		d->frames[nprofiles + i] = d->frames[i];
+		d->frames[nprofiles + i].inverted = 1;
+	}
+
+	d->invert = 0;
+	d->polarity = -1;
+	d->failed = 0;
+	d->nheld = 0;
+	d->guard = (nprofiles > 1);
+	d->claimed = 0;
+	d->claim_start = 0;
+	d->hctr = 0;
+
+	d->dcenter = CENTERSAMP;
+	d->center = 0;
+	d->track = 0;
+	d->track_preamble = profiles[0]->preamble;
+	for (i = 1; i < nprofiles; i++)
+		if (profiles[i]->preamble < d->track_preamble)
+			d->track_preamble = profiles[i]->preamble;
+	d->burst = (unsigned long long) BURST_SLACK * d->track_preamble;
+	d->center_fix = 0;
+	d->track_pending = 0;
+	d->track_level = 0;
+	d->track_pos = 0;
+	d->track_good = 0;
+	d->track_stale = (unsigned long long) TRACK_STALE * d->track_preamble;
+	d->bursts = 0;
+
+	d->squelch = 0;
+	d->awake = 0;
+	d->hang = 0;
+	d->tail_len = 0;
+	d->decoded = 0;
+	d->run_start = 0;
+
+	d->correlate = 0;
+	memset(&d->corr, 0, sizeof(d->corr));
+	d->nhits = 0;
+	d->preambles = 0;
+	d->score = 0;
+
+	d->correct = 0;
+	d->corrected = 0;
+
+	d->learn = 0;
+	d->learned = 0;
+	d->learn_dirty = 0;
+
+	d->samples = 0;
+	d->frames_ok = 0;
+	d->frames_bad = 0;
+	d->on_frame = on_frame;
+	d->ctx = ctx;
+
+	d->runs = (struct slicer_run *) malloc(DECODER_BLOCK * sizeof(struct slicer_run));
+	return (d->runs == NULL) ? -1 : 0;
+}
+
+// Also decode the signal upside down, from the runs below center.  That turns on the
+// guard, even for a single profile, see above.
+static inline void decoder_invert(struct decoder *d)
+{
+	d->invert = 1;
+	d->guard = 1;
+}
+
+// Find preambles with the correlator (-x), with a template of the shortest preamble of
+// the profiles above center behind as many samples below it.  Returns -1 if out of memory.
+static inline int decoder_correlate(struct decoder *d)
+{
+	int w = d->track_preamble;
+
+	if (w > PREAMBLE_WINDOW_MAX / 2)
+		w = PREAMBLE_WINDOW_MAX / 2;
+	if (preamble_corr_init(&d->corr, w, w, 2 * w * CORRELATE_SCORE / 16, DECODER_BLOCK) < 0)
+		return -1;
+	d->correlate = 1;
+	return 0;
+}
+
+// Learn the bit thresholds (-l), starting from the means in t where it has some.  Every
+// frame state moves to frame_step_adaptive(), so the loops specialized for the built in
+// profiles are not used.  Only frames that pass the guard are learned from, so it is on
+// even for a single profile, and repaired frames (-k) are not, since the pulse of the
+// flipped bit is on the wrong side of the threshold.
+static inline void decoder_learn(struct decoder *d, struct adapt_table *t)
+{
+	struct frame_decoder *f;
+	int i;
+
+	for (i = 0; i < 2 * d->nframes; i++) {
+		f = &d->frames[i];
+		pulse_means_init(&f->means, f->profile->minlowbit, f->profile->minhighbit);
+		adapt_find(t, f->profile->name, f->inverted, &f->means);
+		frame_thresholds(f);
+		f->step = frame_step_adaptive;
+	}
+	d->block = decoder_block_multi;
+	d->learn = 1;
+	d->guard = 1;
+}
+
+// Put the learned means in t, of the polarity the signal has
+static inline void decoder_learned(struct decoder *d, struct adapt_table *t)
+{
+	struct frame_decoder *f;
+	int i;
+
+	for (i = 0; i < 2 * d->nframes; i++) {
+		f = &d->frames[i];
+		if (f->frames_ok > 0)
+			adapt_set(t, f->profile->name, f->inverted, &f->means);
+	}
+	d->learned = 0;
+	d->learn_dirty = 0;
+}
+
+static inline void decoder_free(struct decoder *d)
+{
+	free(d->runs);
+	d->runs = NULL;
+	preamble_corr_free(&d->corr);
+}
+
+// Decode any number of samples
+static inline void decoder_process(struct decoder *d, const int16_t *buf, size_t count)
+{
+	size_t len;
+
+	while (count > 0) {
+		len = (count > DECODER_BLOCK) ? DECODER_BLOCK : count;
+		decoder_block(d, buf, len);
+		buf += len;
+		count -= len;
+	}
+}
+
+#endif /* EFERGY_DECODER_H */
@@ -0,0 +1,115 @@
+// efergy_fm.h - In-process FM demodulation of raw rtl_sdr IQ samples
+//
+// rtl_sdr / rtl_tcp deliver interleaved unsigned 8 bit I and Q samples (.cu8).  Instead
+// of piping them through rtl_fm, the decoder can demodulate them itself:
+//
+//	1. Low pass and decimate the IQ stream by summing FM_DECIMATION consecutive samples
+//	   (a boxcar filter, the same thing rtl_fm does in its low_pass() stage).
+//	2. Quadrature discriminate each decimated sample against the previous one.  The phase
+//	   difference is scaled the same way rtl_fm scales it (+/-pi maps to +/-16384), so the
+//	   existing center/hctr logic sees the same kind of values it gets from rtl_fm.
+//
+// The IQ rate must be a whole multiple of the output rate, FM_OUTPUT_RATE unless the
+// decoder runs at another one.  rtl_sdr accepts rates between 225001-300000 and
+// 900001-3200000, so 288000 (decimate by 3, or by 6 for 48000) or 960000 (decimate by 10)
+// are good choices.
+//
+#ifndef EFERGY_FM_H
+#define EFERGY_FM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FM_OUTPUT_RATE		96000	/* Sample rate the pulse thresholds were tuned for */
+#define FM_DEFAULT_IQ_RATE	288000	/* Default rtl_sdr sample rate for IQ input */
+#define FM_PI			(1<<14)	/* Value of pi in the demodulated output */
+
+struct fm_demod {
+	int decimation;		/* IQ samples summed per output sample */
+	int acc_i, acc_q;	/* Boxcar accumulators */
+	int acc_n;		/* IQ samples in the accumulators so far */
+	int pre_i, pre_q;	/* Previous decimated IQ sample */
+	int half;		/* An I byte is pending, waiting for its Q byte */
+	int pending_i;
+};
+
+// Returns 0 on success, -1 if iq_rate is not a whole multiple of out_rate
+static inline int fm_demod_init(struct fm_demod *d, long iq_rate, long out_rate)
+{
+	if ((out_rate <= 0) || (iq_rate < out_rate) || (iq_rate % out_rate) != 0)
+		return -1;
+	d->decimation = iq_rate / out_rate;
+	d->acc_i = d->acc_q = 0;
+	d->acc_n = 0;
+	d->pre_i = d->pre_q = 0;
+	d->half = 0;
+	d->pending_i = 0;
+	return 0;
+}
+
+// Integer atan2 approximation, result scaled so that pi == FM_PI.  Good to about
+// a degree, which is plenty for slicing FSK.
+static inline int fm_fast_atan2(int64_t y, int64_t x)
+{
+	const int64_t pi4 = FM_PI / 4;
+	const int64_t pi34 = 3 * FM_PI / 4;
+	int64_t yabs = (y < 0) ? -y : y;
+	int64_t angle;
+
+	if ((x == 0) && (y == 0))
+		return 0;
+	if (x >= 0)
+		angle = pi4 - pi4 * (x - yabs) / (x + yabs);
+	else
+		angle = pi34 - pi4 * (x + yabs) / (yabs - x);
+	return (int) ((y < 0) ? -angle : angle);
+}
+
+static inline int16_t fm_discriminate(struct fm_demod *d, int i, int q)
+{
+	/* angle of (i,q) * conj(pre_i,pre_q) */
+	int64_t re = (int64_t) i * d->pre_i + (int64_t) q * d->pre_q;
+	int64_t im = (int64_t) q * d->pre_i - (int64_t) i * d->pre_q;
+
+	d->pre_i = i;
+	d->pre_q = q;
+	return (int16_t) fm_fast_atan2(im, re);
+}
+
+// Demodulate nbytes of cu8 IQ data into out[], returning the number of samples written.
+// out[] needs room for nbytes / (2 * decimation) + 1 samples.  Partial IQ pairs and
+// partial decimation windows are carried over to the next call.
+static inline size_t fm_demod_process(struct fm_demod *d, const unsigned char *iq, size_t nbytes, int16_t *out)
+{
+	size_t n = 0;
+	size_t pos = 0;
+
+	if (d->half && nbytes > 0) {
+		d->acc_i += d->pending_i;
+		d->acc_q += iq[pos++] - 127;
+		d->half = 0;
+		if (++d->acc_n == d->decimation) {
+			out[n++] = fm_discriminate(d, d->acc_i, d->acc_q);
+			d->acc_i = d->acc_q = 0;
+			d->acc_n = 0;
+		}
+	}
+
+	for (; pos + 1 < nbytes; pos += 2) {
+		d->acc_i += iq[pos] - 127;
+		d->acc_q += iq[pos+1] - 127;
+		if (++d->acc_n == d->decimation) {
+			out[n++] = fm_discriminate(d, d->acc_i, d->acc_q);
+			d->acc_i = d->acc_q = 0;
+			d->acc_n = 0;
+		}
+	}
+
+	if (pos < nbytes) {
+		d->pending_i = iq[pos] - 127;
+		d->half = 1;
+	}
+	return n;
+}
+
+#endif /* EFERGY_FM_H */
@@ -0,0 +1,318 @@
+// efergy_gen.h - Synthetic Efergy signal
+//
+// Makes up the samples rtl_fm would hand over while an Efergy transmitter sends its
+// frames, so the decoders can be checked and timed without a radio.  Every frame is a
+// stretch of noise (no carrier), the preamble (a long low followed by a long high pulse),
+// then each bit as a low part and a high part that is short for a 0 and long for a 1, and
+// a short low tail:
+//
+//	noise ... | 180 low | 46 high | 13 low, 6 high (0) | 7.5 low, 11.5 high (1) | ...
+//
+// The lengths are in samples at PROFILE_RATE, as measured on real captures.  The signal
+// is built in continuous time and every sample is the average of the levels over its
+// interval, which is what rtl_fm's low pass does, so the pulse edges come out the same way
+// at any rate.  On top of that go gaussian noise, a DC offset that may drift (a dongle
+// warming up moves the FM center), jitter of the pulse lengths and, if asked for, the
+// whole thing upside down like rtl_fm hands it over at some tuning offsets.
+//
+// The random numbers come from a seeded xorshift, so a given set of parameters always
+// gives the same samples.  Nothing here needs libm: the noise is a sum of uniform numbers
+// and the IQ output uses a sine table worked out from a Taylor series.
+//
+// Usage:
+//
+//	struct gen_params p;
+//	struct gen g;
+//	struct gen_buf buf = { NULL, 0, 0 };
+//	unsigned char bytes[PROFILE_MAX_BYTES];
+//	double watts;
+//
+//	gen_params_init(&p);			(96000, no noise, then change what's needed)
+//	gen_init(&g, &p);
+//	watts = gen_frame_bytes(profile, 0x0912a4b0, 1234.5, bytes);	(what the decoder will log)
+//	if (gen_frame(&g, &buf, bytes, profile->bytecount) < 0) ...	(appends to buf.s)
+//	... buf.s[0 .. buf.n) ...
+//	free(buf.s);
+//
+#ifndef EFERGY_GEN_H
+#define EFERGY_GEN_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "efergy_profile.h"
+#include "efergy_watts.h"
+#include "efergy_fm.h"
+
+#define GEN_BIT			19.0	/* Samples per bit at PROFILE_RATE */
+#define GEN_SHORT		6.0	/* High samples of a 0 */
+#define GEN_LONG		11.5	/* High samples of a 1 */
+#define GEN_PREAMBLE_LOW	180.0	/* Low samples ahead of the preamble pulse */
+#define GEN_PREAMBLE_HIGH	46.0	/* High samples of the preamble pulse */
+#define GEN_TAIL		30.0	/* Low samples after the last bit */
+#define GEN_LEVEL		8000	/* Distance of the FSK levels from the center */
+#define GEN_GAP_NOISE		4000	/* Noise between frames, where rtl_fm hears no carrier */
+#define GEN_IQ_AMPLITUDE	100	/* Of the cu8 IQ samples around 127 */
+#define GEN_SINE_BITS		12	/* Sine table of 4096 entries for the IQ output */
+
+struct gen_params {
+	long rate;		/* Samples per second */
+	double level;		/* Distance of the FSK levels from the center */
+	double noise;		/* Standard deviation of the noise during a frame */
+	double gap_noise;	/* and between frames */
+	double dc;		/* Center of the signal */
+	double drift;		/* Change of the center per second */
+	double jitter;		/* Standard deviation of the pulse lengths, in microseconds */
+	double gap;		/* Seconds of noise ahead of every frame */
+	int inverted;		/* Signal upside down */
+	uint64_t seed;
+};
+
+struct gen {
+	struct gen_params p;
+	uint64_t rng;		/* xorshift64* state */
+	double scale;		/* Samples at p.rate per sample at PROFILE_RATE */
+	double noise;		/* Noise of what is being written */
+	double acc;		/* Levels summed over the sample being built */
+	double fill;		/* Part of that sample covered so far */
+	unsigned long long samples;	/* Samples written so far */
+};
+
+// Samples written by gen_frame() and gen_gap(), appended to s.  Start it out as { NULL, 0, 0 }.
+struct gen_buf {
+	int16_t *s;
+	size_t n;
+	size_t max;
+};
+
+struct gen_iq {
+	int decimation;		/* IQ samples per sample */
+	uint32_t phase;		/* 2^32 is a whole turn */
+	int8_t sine[1 << GEN_SINE_BITS];	/* GEN_IQ_AMPLITUDE * sin() of a turn */
+};
+
+static inline void gen_params_init(struct gen_params *p)
+{
+	p->rate = PROFILE_RATE;
+	p->level = GEN_LEVEL;
+	p->noise = 0;
+	p->gap_noise = GEN_GAP_NOISE;
+	p->dc = 0;
+	p->drift = 0;
+	p->jitter = 0;
+	p->gap = 0.05;
+	p->inverted = 0;
+	p->seed = 1;
+}
+
+static inline void gen_init(struct gen *g, const struct gen_params *p)
+{
+	g->p = *p;
+	g->rng = p->seed ? p->seed : 1;	/* xorshift is stuck at 0 */
+	g->scale = (double) p->rate / PROFILE_RATE;
+	g->noise = 0;
+	g->acc = 0;
+	g->fill = 0;
+	g->samples = 0;
+}
+
+static inline uint64_t gen_random(struct gen *g)
+{
+	g->rng ^= g->rng >> 12;
+	g->rng ^= g->rng << 25;
+	g->rng ^= g->rng >> 27;
+	return g->rng * 0x2545f4914f6cdd1dULL;
+}
+
+// Uniform in [0, 1)
+static inline double gen_uniform(struct gen *g)
+{
+	return (gen_random(g) >> 11) * 0x1p-53;
+}
+
+// Close to a standard normal: the sum of 12 uniform numbers has a variance of 1
+static inline double gen_gauss(struct gen *g)
+{
+	double s = -6;
+	int i;
+
+	for (i = 0; i < 12; i++)
+		s += gen_uniform(g);
+	return s;
+}
+
+// Frame bytes for a reading of watts from transmitter id.  Returns the reading the
+// decoder will work out from them, watts to the precision the frame can carry.
+static inline double gen_frame_bytes(const struct device_profile *prof, uint32_t id, double watts, unsigned char *bytes)
+{
+	double x = 0;
+	unsigned int adc;
+	unsigned char sum = 0;
+	int e = 0;
+	int i;
+
+	/* the smallest exponent the ADC value fits in 16 bits with keeps the most precision */
+	if (watts > 0 && prof->voltage > 0)
+		for (e = -128; e < 127; e++) {
+			x = watts / (prof->voltage * watt_scale[(unsigned char) e]);
+			if (x < 65535.5)
+				break;
+		}
+	adc = (x < 65535.5) ? (unsigned int) (x + 0.5) : 65535;
+
+	bytes[0] = id >> 24;
+	bytes[1] = id >> 16;
+	bytes[2] = id >> 8;
+	bytes[3] = id;
+	bytes[4] = adc >> 8;
+	bytes[5] = adc;
+	bytes[6] = (unsigned char) e;
+	for (i = 7; i < prof->bytecount - 1; i++)
+		bytes[i] = 0;
+	for (i = 0; i < prof->bytecount - 1; i++)
+		sum += bytes[i];
+	bytes[prof->bytecount - 1] = sum;
+	return watts_calc(prof->voltage, adc, (unsigned char) e);
+}
+
+// Returns -1 if out of memory
+static inline int gen_put(struct gen *g, struct gen_buf *b)
+{
+	double v;
+	int16_t *s;
+
+	if (b->n == b->max) {
+		s = (int16_t *) realloc(b->s, (b->max ? 2 * b->max : 65536) * sizeof(int16_t));
+		if (s == NULL)
+			return -1;
+		b->s = s;
+		b->max = b->max ? 2 * b->max : 65536;
+	}
+	v = g->acc + g->p.dc + g->p.drift * g->samples / g->p.rate;
+	if (g->p.inverted)
+		v = -v;
+	v += g->noise * gen_gauss(g);
+	v += (v < 0) ? -0.5 : 0.5;
+	b->s[b->n++] = (v > 32767) ? 32767 : (v < -32768) ? -32768 : (int16_t) v;
+	g->samples++;
+	g->acc = 0;
+	g->fill = 0;
+	return 0;
+}
+
+// Level for len samples (at the generator's rate, need not be whole)
+static inline int gen_level(struct gen *g, struct gen_buf *b, double level, double len)
+{
+	double take;
+
+	while (len > 0) {
+		take = 1 - g->fill;
+		if (take > len)
+			take = len;
+		g->acc += level * take;
+		g->fill += take;
+		len -= take;
+		if (g->fill > 1 - 1e-9 && gen_put(g, b) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+// A pulse of len samples at PROFILE_RATE, with jitter
+static inline double gen_length(struct gen *g, double len)
+{
+	len = len * g->scale + g->p.jitter * 1e-6 * g->p.rate * gen_gauss(g);
+	return (len < 0) ? 0 : len;
+}
+
+// Noise, as between frames, for the given number of seconds
+static inline int gen_gap(struct gen *g, struct gen_buf *b, double seconds)
+{
+	g->noise = g->p.gap_noise;
+	return gen_level(g, b, 0, seconds * g->p.rate);
+}
+
+// The gap of the parameters, then a frame of the n bytes
+static inline int gen_frame(struct gen *g, struct gen_buf *b, const unsigned char *bytes, int n)
+{
+	double high, low = -g->p.level;
+	int i, k;
+
+	if (gen_gap(g, b, g->p.gap) < 0)
+		return -1;
+	g->noise = g->p.noise;
+	if (gen_level(g, b, low, gen_length(g, GEN_PREAMBLE_LOW)) < 0 ||
+			gen_level(g, b, g->p.level, gen_length(g, GEN_PREAMBLE_HIGH)) < 0)
+		return -1;
+	for (i = 0; i < n; i++)
+		for (k = 7; k >= 0; k--) {
+			/* the jitter moves the falling edge, the bit keeps its length */
+			high = gen_length(g, ((bytes[i] >> k) & 1) ? GEN_LONG : GEN_SHORT);
+			if (high > GEN_BIT * g->scale)
+				high = GEN_BIT * g->scale;
+			if (gen_level(g, b, low, GEN_BIT * g->scale - high) < 0 ||
+					gen_level(g, b, g->p.level, high) < 0)
+				return -1;
+		}
+	return gen_level(g, b, low, gen_length(g, GEN_TAIL));
+}
+
+// sin(x) for x in [-pi, pi], plenty precise for an 8 bit sine table
+static inline double gen_sin(double x)
+{
+	double term = x, sum = x;
+	int i;
+
+	for (i = 1; i < 12; i++) {
+		term *= -x * x / ((2 * i) * (2 * i + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+// cu8 IQ output for rtl_sdr captures at iq_rate, for samples at rate.  Returns -1 if
+// iq_rate is not a whole multiple of rate.
+static inline int gen_iq_init(struct gen_iq *m, long iq_rate, long rate)
+{
+	const double pi = 3.14159265358979323846;
+	double x;
+	int i;
+
+	if (rate <= 0 || iq_rate < rate || iq_rate % rate != 0)
+		return -1;
+	m->decimation = iq_rate / rate;
+	m->phase = 0;
+	for (i = 0; i < (1 << GEN_SINE_BITS); i++) {
+		x = 2 * pi * i / (1 << GEN_SINE_BITS);
+		if (x > pi)
+			x -= 2 * pi;
+		m->sine[i] = (int8_t) (GEN_IQ_AMPLITUDE * gen_sin(x) + (x < 0 ? -0.5 : 0.5));
+	}
+	return 0;
+}
+
+// Frequency modulate n samples into iq[], which needs room for 2 * decimation * n bytes.
+// Every sample turns the phase by sample / FM_PI half turns over its decimation IQ
+// samples, which efergy_fm.h (or rtl_fm) turns back into the same sample.
+static inline size_t gen_iq_process(struct gen_iq *m, const int16_t *s, size_t n, unsigned char *iq)
+{
+	const uint32_t quarter = 1u << (GEN_SINE_BITS - 2);
+	const uint32_t mask = (1u << GEN_SINE_BITS) - 1;
+	size_t out = 0;
+	uint32_t step, k;
+	size_t i;
+	int j;
+
+	for (i = 0; i < n; i++) {
+		/* FM_PI is half a turn, 2^31 */
+		step = (uint32_t) (((int64_t) s[i] << 31) / ((int64_t) FM_PI * m->decimation));
+		for (j = 0; j < m->decimation; j++) {
+			m->phase += step;
+			k = m->phase >> (32 - GEN_SINE_BITS);
+			iq[out++] = (unsigned char) (127 + m->sine[(k + quarter) & mask]);
+			iq[out++] = (unsigned char) (127 + m->sine[k]);
+		}
+	}
+	return out;
+}
+
+#endif /* EFERGY_GEN_H */
@@ -0,0 +1,131 @@
+// efergy_meter.h - Per transmitter state
+//
+// Bytes 0-3 of every frame identify the transmitter that sent it.  With the neighbours'
+// meters in range their readings used to end up interleaved in one log with no way to
+// tell them apart.  The decoder now looks each reading's id up in a small table that
+// keeps the last reading and a few counters per transmitter, and can be told to keep
+// only the ids it is interested in, so unwanted frames are dropped before they are ever
+// formatted or written.
+//
+// Usage:
+//
+//	struct meter_table meters;
+//
+//	meter_table_init(&meters);
+//	meter_filter_add(&meters, 0x0912a4b0);		(optional, for each wanted id)
+//	if (meter_update(&meters, rd.id, rd.time, rd.milliwatts, &rd.meter)) ... log it	(for each valid reading)
+//
+// The table is only touched by the decode thread.
+//
+#ifndef EFERGY_METER_H
+#define EFERGY_METER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define METER_MAX		64	/* Most transmitters tracked at once */
+
+struct meter {
+	uint32_t id;		/* Frame bytes 0-3 */
+	time_t first_time;	/* Time of the first reading */
+	time_t last_time;	/* Time of the latest reading */
+	int64_t last_milli;	/* Latest reading times 1000 */
+	unsigned long readings;	/* Valid frames received */
+};
+
+struct meter_table {
+	struct meter meters[METER_MAX];
+	int count;
+	int last;		/* Meter of the previous reading, looked at first */
+	uint32_t filter[METER_MAX];	/* Only keep these ids, if any are given */
+	int nfilter;
+	unsigned long filtered;	/* Readings dropped by the filter */
+	unsigned long overflow;	/* Readings not tracked because the table was full */
+};
+
+static inline void meter_table_init(struct meter_table *t)
+{
+	t->count = 0;
+	t->last = 0;
+	t->nfilter = 0;
+	t->filtered = 0;
+	t->overflow = 0;
+}
+
+// Keep readings of transmitter id.  Returns -1 if the filter is full.
+static inline int meter_filter_add(struct meter_table *t, uint32_t id)
+{
+	if (t->nfilter == METER_MAX)
+		return -1;
+	t->filter[t->nfilter++] = id;
+	return 0;
+}
+
+// Parse a transmitter id as printed by the -t option (hex, 0x optional).  Returns -1 if
+// s is not one.
+static inline int meter_parse_id(const char *s, uint32_t *id)
+{
+	char *end;
+	unsigned long v;
+
+	v = strtoul(s, &end, 16);
+	if (*end != '\0' || end == s || v > 0xffffffffUL)
+		return -1;
+	*id = (uint32_t) v;
+	return 0;
+}
+
+// Index of the meter for id, or -1 if there is none yet
+static inline int meter_find(struct meter_table *t, uint32_t id)
+{
+	int i;
+
+	/* transmitters report every few seconds, the previous one is a good guess */
+	if (t->last < t->count && t->meters[t->last].id == id)
+		return t->last;
+	for (i = 0; i < t->count; i++)
+		if (t->meters[i].id == id)
+			return t->last = i;
+	return -1;
+}
+
+// Record a valid reading and set *meter to the index of its meter.  Returns 0 if the
+// reading is to be dropped because of the filter.  When the table is full the reading is
+// kept but not tracked, and *meter is set to -1.
+static inline int meter_update(struct meter_table *t, uint32_t id, time_t when, int64_t milli, int *meter)
+{
+	struct meter *m;
+	int i;
+
+	i = meter_find(t, id);
+	if (i < 0) {
+		if (t->nfilter > 0) {
+			for (i = 0; i < t->nfilter; i++)
+				if (t->filter[i] == id)
+					break;
+			if (i == t->nfilter) {
+				t->filtered++;
+				return 0;
+			}
+		}
+		if (t->count == METER_MAX) {
+			t->overflow++;
+			*meter = -1;
+			return 1;
+		}
+		i = t->last = t->count++;
+		m = &t->meters[i];
+		m->id = id;
+		m->first_time = when;
+		m->readings = 0;
+	}
+	m = &t->meters[i];
+	m->last_time = when;
+	m->last_milli = milli;
+	m->readings++;
+	*meter = i;
+	return 1;
+}
+
+#endif /* EFERGY_METER_H */
@@ -0,0 +1,208 @@
+// efergy_pipeline.h - Reader thread feeding the decoder through a ring of blocks
+//
+// In the normal loop one thread reads a block, demodulates it (-i) or averages it down
+// (-D), decodes it and only then reads the next one, so anything that holds up the
+// decoder holds up the pipe from rtl_fm as well.  With the pipeline the sample reader
+// runs on a thread of its own and hands full blocks to the decode thread through a single
+// producer / single consumer ring of PIPELINE_BLOCKS blocks.  Together with the log
+// writer thread (efergy_writer.h) that makes three stages:
+//
+//	reader (read(2), FM demodulation, decimation) -> decoder -> writer (formatting, I/O)
+//
+// each of which can be pinned to a core of its own.  The slicer and the frame decoder stay
+// on one thread: a checksum error makes the decoder resample the wave center right after
+// the failed frame, so the slicer can't run ahead of the frames without changing what is
+// decoded.
+//
+// When the ring is full the reader waits for the decoder, which holds up rtl_fm just like
+// a decoder that doesn't read.  If there is still no room after PIPELINE_WAIT_MS the
+// decoder is taken to have fallen behind for good: the block is dropped and counted in
+// pipeline.dropped, so rtl_fm keeps going and the decoder catches up on later blocks.
+// The next block that does go through carries the number of samples dropped ahead of it,
+// which pipeline_next() leaves in pipeline.gap, so the decoder can start over there
+// (decoder_skip()) instead of joining the samples on either side into one pulse.
+// Replays set pipeline.wait, then the reader waits as long as it takes.
+//
+// Usage:
+//
+//	struct pipeline p;
+//	const int16_t *buf;
+//	size_t count;
+//
+//	if (pipeline_start(&p, &reader, wait, cpu) < 0) ...	(cpu -1 for any)
+//	while ((count = pipeline_next(&p, &buf)) > 0) {
+//		if (p.gap > 0) ... p.gap samples were dropped ahead of buf ...
+//		... buf[0 .. count) ...
+//		pipeline_release(&p);
+//	}
+//	pipeline_stop(&p);
+//
+// Link with -lpthread.
+//
+#ifndef EFERGY_PIPELINE_H
+#define EFERGY_PIPELINE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* pthread_setaffinity_np() */
+#endif
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include "efergy_reader.h"
+
+#define PIPELINE_BLOCKS		32	/* Blocks in the ring, about 0.3 s of samples at 96000 */
+#define PIPELINE_BLOCK		(READER_BLOCK_BYTES/2)	/* Samples per block */
+#define PIPELINE_WAIT_MS	100	/* Longest wait for room in the ring before dropping a block */
+
+struct pipeline {
+	struct sample_reader *reader;
+	int16_t *blocks;	/* PIPELINE_BLOCKS of PIPELINE_BLOCK samples */
+	size_t count[PIPELINE_BLOCKS];	/* Samples in each block, 0 for the end of the stream */
+	unsigned long long skipped[PIPELINE_BLOCKS];	/* Samples dropped right before each block */
+	unsigned long long gap;	/* and before the block pipeline_next() returned */
+	unsigned int head;	/* Next block the reader fills */
+	unsigned int tail;	/* Next block the decoder takes */
+	sem_t full;		/* Blocks waiting for the decoder */
+	sem_t empty;		/* Blocks free for the reader */
+	int wait;		/* Wait for room as long as it takes, never drop */
+	int cpu;		/* Core of the reader thread, -1 for any */
+	unsigned long dropped;	/* Blocks the decoder didn't get */
+	unsigned long long dropped_samples;
+	int peak;		/* Most blocks ever waiting for the decoder */
+	pthread_t thread;
+};
+
+// Run the calling thread, or thread, on the given core.  Returns -1 if that can't be done.
+static inline int pipeline_pin(pthread_t thread, int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return -1;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return (pthread_setaffinity_np(thread, sizeof(set), &set) == 0) ? 0 : -1;
+#else
+	(void) thread;
+	(void) cpu;
+	return -1;
+#endif
+}
+
+// Wait up to PIPELINE_WAIT_MS for a free block.  Returns -1 if there is none.
+static inline int pipeline_room(struct pipeline *p)
+{
+	struct timespec ts;
+	int r;
+
+	if (sem_trywait(&p->empty) == 0)
+		return 0;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += PIPELINE_WAIT_MS * 1000000L;
+	ts.tv_sec += ts.tv_nsec / 1000000000L;
+	ts.tv_nsec %= 1000000000L;
+	while ((r = sem_timedwait(&p->empty, &ts)) < 0 && errno == EINTR)
+		;
+	return r;
+}
+
+static inline void *pipeline_reader_thread(void *arg)
+{
+	struct pipeline *p = (struct pipeline *) arg;
+	unsigned long long skipped = 0;
+	size_t count;
+	int i;
+
+	if (p->cpu >= 0 && pipeline_pin(pthread_self(), p->cpu) < 0)
+		fprintf(stderr, "Can't run the reader on core %d\n", p->cpu);
+	do {
+		count = sample_reader_fill(p->reader);
+		if (count > 0 && !p->wait && pipeline_room(p) < 0) {
+			p->dropped++;
+			p->dropped_samples += count;
+			skipped += count;
+			continue;
+		}
+		if (count == 0 || p->wait)
+			while (sem_wait(&p->empty) < 0 && errno == EINTR)
+				;
+		i = p->head & (PIPELINE_BLOCKS - 1);
+		memcpy(p->blocks + (size_t) i * PIPELINE_BLOCK, p->reader->buf, count * sizeof(int16_t));
+		p->count[i] = count;
+		p->skipped[i] = skipped;
+		skipped = 0;
+		p->head++;
+		sem_post(&p->full);
+	} while (count > 0);
+	return NULL;
+}
+
+// Start reading blocks from reader on a thread of its own.  Returns -1 on error.
+static inline int pipeline_start(struct pipeline *p, struct sample_reader *reader, int wait, int cpu)
+{
+	void *mem;
+
+	p->reader = reader;
+	p->head = 0;
+	p->tail = 0;
+	p->wait = wait;
+	p->cpu = cpu;
+	p->gap = 0;
+	p->dropped = 0;
+	p->dropped_samples = 0;
+	p->peak = 0;
+	if (posix_memalign(&mem, READER_ALIGN, (size_t) PIPELINE_BLOCKS * PIPELINE_BLOCK * sizeof(int16_t)) != 0)
+		return -1;
+	p->blocks = (int16_t *) mem;
+	if (sem_init(&p->full, 0, 0) < 0 || sem_init(&p->empty, 0, PIPELINE_BLOCKS) < 0) {
+		free(p->blocks);
+		return -1;
+	}
+	if (pthread_create(&p->thread, NULL, pipeline_reader_thread, p) != 0) {
+		sem_destroy(&p->full);
+		sem_destroy(&p->empty);
+		free(p->blocks);
+		return -1;
+	}
+	return 0;
+}
+
+// Wait for the next block.  Returns the number of samples in *buf, 0 at the end of the
+// stream.  Hand the block back with pipeline_release() once it is decoded.
+static inline size_t pipeline_next(struct pipeline *p, const int16_t **buf)
+{
+	int i, n;
+
+	while (sem_wait(&p->full) < 0 && errno == EINTR)
+		;
+	if (sem_getvalue(&p->full, &n) == 0 && n + 1 > p->peak)
+		p->peak = n + 1;
+	i = p->tail & (PIPELINE_BLOCKS - 1);
+	*buf = p->blocks + (size_t) i * PIPELINE_BLOCK;
+	p->gap = p->skipped[i];
+	return p->count[i];
+}
+
+static inline void pipeline_release(struct pipeline *p)
+{
+	p->tail++;
+	sem_post(&p->empty);
+}
+
+// Wait for the reader thread to finish, after pipeline_next() returned 0
+static inline void pipeline_stop(struct pipeline *p)
+{
+	pthread_join(p->thread, NULL);
+	sem_destroy(&p->full);
+	sem_destroy(&p->empty);
+	free(p->blocks);
+	p->blocks = NULL;
+}
+
+#endif /* EFERGY_PIPELINE_H */
@@ -0,0 +1,151 @@
+// efergy_pool.h - Small work stealing thread pool
+//
+// Used to decode a corpus of recorded captures on all cores.  Every worker has its own
+// queue of tasks.  A worker takes tasks from the back of its own queue and, once that is
+// empty, steals from the front of the other queues, so a worker that got a few long
+// captures doesn't hold everyone up while the rest sit idle.
+//
+// All tasks are queued before pool_run() starts the workers and tasks don't queue new
+// ones, so the pool is done as soon as every queue is empty.
+//
+// Usage:
+//
+//	struct pool pool;
+//
+//	if (pool_init(&pool, nworkers, ntasks) < 0) ...
+//	pool_add(&pool, decode_chunk, &chunks[i]);	(for each task)
+//	pool_run(&pool);				(returns when all tasks are done)
+//	pool_free(&pool);
+//
+// Link with -lpthread.
+//
+#ifndef EFERGY_POOL_H
+#define EFERGY_POOL_H
+
+#include <stdlib.h>
+#include <pthread.h>
+
+struct pool_task {
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct pool_queue {
+	pthread_mutex_t lock;
+	struct pool_task *tasks;
+	int head;		/* Next task to steal */
+	int tail;		/* One past the task the owner takes next */
+};
+
+struct pool_worker {
+	struct pool *pool;
+	int id;
+	pthread_t thread;
+};
+
+struct pool {
+	int nworkers;
+	int next;		/* Queue the next pool_add() goes to */
+	struct pool_queue *queues;
+	struct pool_worker *workers;
+};
+
+// Room for up to ntasks tasks in total.  Returns -1 if out of memory.
+static inline int pool_init(struct pool *p, int nworkers, int ntasks)
+{
+	int i;
+
+	if (nworkers < 1)
+		nworkers = 1;
+	p->nworkers = nworkers;
+	p->next = 0;
+	p->queues = (struct pool_queue *) calloc(nworkers, sizeof(struct pool_queue));
+	p->workers = (struct pool_worker *) calloc(nworkers, sizeof(struct pool_worker));
+	if (p->queues == NULL || p->workers == NULL)
+		return -1;
+	for (i = 0; i < nworkers; i++) {
+		/* a single worker may end up with every task */
+		p->queues[i].tasks = (struct pool_task *) malloc((ntasks > 0 ? ntasks : 1) * sizeof(struct pool_task));
+		if (p->queues[i].tasks == NULL)
+			return -1;
+		pthread_mutex_init(&p->queues[i].lock, NULL);
+	}
+	return 0;
+}
+
+// Queue a task.  Tasks are dealt out to the workers round robin.
+static inline void pool_add(struct pool *p, void (*fn)(void *arg), void *arg)
+{
+	struct pool_queue *q = &p->queues[p->next];
+
+	q->tasks[q->tail].fn = fn;
+	q->tasks[q->tail].arg = arg;
+	q->tail++;
+	p->next = (p->next + 1) % p->nworkers;
+}
+
+// Take a task from the back of queue q (own) or the front (steal).  Returns 0 if empty.
+static inline int pool_take(struct pool_queue *q, int steal, struct pool_task *task)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		*task = steal ? q->tasks[q->head++] : q->tasks[--q->tail];
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static inline void *pool_worker_thread(void *arg)
+{
+	struct pool_worker *w = (struct pool_worker *) arg;
+	struct pool *p = w->pool;
+	struct pool_task task;
+	int found;
+	int i;
+
+	for (;;) {
+		found = pool_take(&p->queues[w->id], 0, &task);
+		for (i = 1; !found && i < p->nworkers; i++)
+			found = pool_take(&p->queues[(w->id + i) % p->nworkers], 1, &task);
+		if (!found)
+			return NULL;
+		task.fn(task.arg);
+	}
+}
+
+// Run every queued task and wait for them to finish.  The calling thread works as
+// worker 0.
+static inline void pool_run(struct pool *p)
+{
+	int i;
+
+	for (i = 0; i < p->nworkers; i++) {
+		p->workers[i].pool = p;
+		p->workers[i].id = i;
+	}
+	for (i = 1; i < p->nworkers; i++)
+		if (pthread_create(&p->workers[i].thread, NULL, pool_worker_thread, &p->workers[i]) != 0)
+			p->workers[i].id = -1;	/* its tasks get stolen by the others */
+	pool_worker_thread(&p->workers[0]);
+	for (i = 1; i < p->nworkers; i++)
+		if (p->workers[i].id >= 0)
+			pthread_join(p->workers[i].thread, NULL);
+}
+
+static inline void pool_free(struct pool *p)
+{
+	int i;
+
+	for (i = 0; i < p->nworkers; i++) {
+		if (p->queues[i].tasks != NULL)
+			pthread_mutex_destroy(&p->queues[i].lock);
+		free(p->queues[i].tasks);
+	}
+	free(p->queues);
+	free(p->workers);
+}
+
+#endif /* EFERGY_POOL_H */
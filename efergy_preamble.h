@@ -0,0 +1,129 @@
+// efergy_preamble.h - Preamble correlator
+//
+// A frame starts with a long stretch below center followed by a long pulse above it.
+// The decoder used to take any pulse of more than PREAMBLE_COUNT samples above center
+// as the preamble, so a single noise sample dipping below center in the middle of it lost
+// the whole frame.  The correlator matches the samples against the shape of the preamble
+// instead, low samples followed by high samples:
+//
+//	score = (samples above center - samples below) over the high part
+//	      - (samples above center - samples below) over the low part in front of it
+//
+// which is low + high for a clean preamble and loses only 2 per noise sample in it.  The
+// scores of a whole block come from a running sum of the sample classes, so apart from
+// that sum every pass is a plain loop over arrays that the compiler vectorizes.
+//
+// A hit is reported at each peak of the score at or above the threshold, with the
+// position of the last sample of the high part (counted from the start of the stream)
+// and the score as a measure of quality.  The positions of successive blocks carry on
+// from each other, so a preamble split over two blocks is still found.
+//
+#ifndef EFERGY_PREAMBLE_H
+#define EFERGY_PREAMBLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PREAMBLE_WINDOW_MAX	512	/* Longest low + high template */
+
+struct preamble_hit {
+	unsigned long long pos;	/* Last sample of the high part */
+	int score;		/* Out of low + high */
+};
+
+struct preamble_corr {
+	int low;		/* Samples of the low part of the template */
+	int high;		/* Samples of the high part */
+	int threshold;		/* Lowest score that counts */
+	int prev;		/* Score of the previous sample */
+	int rising;		/* The score went up last time it changed */
+	int8_t hist[PREAMBLE_WINDOW_MAX];	/* Classes of the last low + high samples */
+	size_t max;		/* Most samples per call */
+	int8_t *sign;		/* Scratch, hist followed by the classes of the block */
+	int32_t *sum;		/* Scratch, running sum of sign */
+	int32_t *score;		/* Scratch, score for each sample of the block */
+};
+
+static inline void preamble_corr_reset(struct preamble_corr *c)
+{
+	memset(c->hist, 0, sizeof(c->hist));
+	c->prev = 0;
+	c->rising = 0;
+}
+
+// Template of low + high samples, hits need a score of at least threshold.  Up to max
+// samples can be passed per call.  Returns -1 if out of memory or the template is too
+// long.
+static inline int preamble_corr_init(struct preamble_corr *c, int low, int high, int threshold, size_t max)
+{
+	c->sign = NULL;
+	c->sum = NULL;
+	c->score = NULL;
+	if (low < 1 || high < 1 || low + high > PREAMBLE_WINDOW_MAX)
+		return -1;
+	c->low = low;
+	c->high = high;
+	c->threshold = threshold;
+	c->max = max;
+	c->sign = (int8_t *) malloc(PREAMBLE_WINDOW_MAX + max);
+	c->sum = (int32_t *) malloc((PREAMBLE_WINDOW_MAX + max + 1) * sizeof(int32_t));
+	c->score = (int32_t *) malloc(max * sizeof(int32_t));
+	preamble_corr_reset(c);
+	return (c->sign == NULL || c->sum == NULL || c->score == NULL) ? -1 : 0;
+}
+
+static inline void preamble_corr_free(struct preamble_corr *c)
+{
+	free(c->sign);
+	free(c->sum);
+	free(c->score);
+	c->sign = NULL;
+	c->sum = NULL;
+	c->score = NULL;
+}
+
+// Correlate the next n (at most c->max) samples, the first of which is sample number base
+// of the stream.  Returns the number of hits written to hits[], at most maxhits.
+static inline size_t preamble_corr_process(struct preamble_corr *c, const int16_t *samp, size_t n, int center,
+		unsigned long long base, struct preamble_hit *hits, size_t maxhits)
+{
+	const int w = c->low + c->high;
+	int8_t *s = c->sign;
+	int32_t *p = c->sum;
+	int32_t *score = c->score;
+	size_t nhits = 0;
+	size_t i;
+
+	/* classes of the samples, behind the last w of the previous call */
+
+	memcpy(s, c->hist, w);
+	for (i = 0; i < n; i++)
+		s[w + i] = (samp[i] > center) - (samp[i] < center);
+
+	p[0] = 0;
+	for (i = 0; i < w + n; i++)
+		p[i + 1] = p[i] + s[i];
+
+	/* the template ending with sample i covers s[i + 1, i + 1 + w) */
+
+	for (i = 0; i < n; i++)
+		score[i] = p[w + i + 1] - 2 * p[i + 1 + c->low] + p[i + 1];
+
+	for (i = 0; i < n; i++) {
+		if (score[i] != c->prev) {
+			if (score[i] < c->prev && c->rising && c->prev >= c->threshold && nhits < maxhits) {
+				hits[nhits].pos = base + i - 1;
+				hits[nhits].score = c->prev;
+				nhits++;
+			}
+			c->rising = (score[i] > c->prev);
+			c->prev = score[i];
+		}
+	}
+
+	memcpy(c->hist, s + n, w);
+	return nhits;
+}
+
+#endif /* EFERGY_PREAMBLE_H */
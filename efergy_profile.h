@@ -0,0 +1,244 @@
+// efergy_profile.h - Device profiles
+//
+// The pulse thresholds, frame length, checksum and voltage scaling differ between Efergy
+// transmitters.  They used to be #defines that had to be edited and recompiled to switch
+// between an E2 Classic and an Elite 3.0 TPM.  Now they live in a profile picked at
+// runtime, either one of the built in ones below or one read from a config file:
+//
+//	# Lines starting with # are comments
+//	[elite-site2]
+//	minlowbit = 3		# Min number of positive samples for a logic 0
+//	minhighbit = 10		# Min number of positive samples for a logic 1
+//	bytecount = 9		# Frame length in bytes, including the checksum byte
+//	checksum = sum		# sum: last byte is the sum of the others, none: no check
+//	voltage = 1		# Reference voltage, 1 for the Elite 3.0 TPM
+//	preamble = 40		# Min number of positive samples for a valid preamble
+//	rate = 96000		# Sample rate the counts above are for
+//
+// Keys that are left out keep the E2 Classic values.  A profile in the config file with
+// the name of a built in one replaces it.
+//
+// The decoder has a specialized copy of its loop, with the thresholds as constants, for
+// each built in profile.  Profiles from a config file that match one of them use it too,
+// anything else runs on a generic copy that reads the thresholds from the profile.
+//
+// The thresholds are counts of samples, so they only hold at the rate they were tuned
+// for, rtl_fm's -r 96000 for the built in ones.  profile_at_rate() converts a profile to
+// another rate by keeping the time each threshold stands for, so rtl_fm can run at 48000
+// or 32000 without the samples having to be resampled back to 96000 first.
+//
+#ifndef EFERGY_PROFILE_H
+#define EFERGY_PROFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// Standard definitions for  Efergy E2 classic decoding
+#define E2_MINLOWBIT		3	/* Min number of positive samples for a logic 0 */
+#define E2_MINHIGHBIT		8	/* Min number of positive samples for a logic 1 */
+#define E2_BYTECOUNT		8	/* Efergy RF Message Byte Count */
+#define E2_VOLTAGE		240	/* Refernce Volatage */
+#define E2_PREAMBLE_COUNT	40	/* Number of positive samples for a valid preamble */
+
+// Alternate  definitions for the Efergy Elite 3.0 TPM
+#define ELITE_MINLOWBIT		3	/* Min number of positive samples for a logic 0 */
+#define ELITE_MINHIGHBIT	9	/* Min number of positive samples for a logic 1 */
+#define ELITE_BYTECOUNT		9	/* Elite 3.0 TPM frames are 9 bytes */
+#define ELITE_VOLTAGE		1	/* For Efergy Elite 3.0 TPM,  set to 1 */
+#define ELITE_PREAMBLE_COUNT	40	/* Number of positive samples for a valid preamble */
+
+#define PROFILE_MAX_BYTES	16	/* Longest frame a profile may ask for */
+#define PROFILE_MAX		16	/* Most profiles known at once */
+#define PROFILE_NAME_MAX	32
+#define PROFILE_RATE		96000	/* Sample rate of the built in thresholds */
+
+#define CHECKSUM_NONE		0	/* Accept every frame */
+#define CHECKSUM_SUM		1	/* Last byte is the sum of the others, mod 256 */
+
+struct device_profile {
+	char name[PROFILE_NAME_MAX];
+	int minlowbit;
+	int minhighbit;
+	int bytecount;
+	int checksum;		/* CHECKSUM_ scheme */
+	double voltage;
+	int preamble;
+	long long voltage_milli;	/* voltage * 1000, for integer readings */
+	long rate;		/* Samples per second the counts are for */
+};
+
+struct profile_table {
+	struct device_profile profiles[PROFILE_MAX];
+	int count;
+};
+
+static const struct device_profile profile_builtin[] = {
+	{ "e2", E2_MINLOWBIT, E2_MINHIGHBIT, E2_BYTECOUNT, CHECKSUM_SUM, E2_VOLTAGE, E2_PREAMBLE_COUNT, E2_VOLTAGE * 1000LL, PROFILE_RATE },
+	{ "elite", ELITE_MINLOWBIT, ELITE_MINHIGHBIT, ELITE_BYTECOUNT, CHECKSUM_SUM, ELITE_VOLTAGE, ELITE_PREAMBLE_COUNT, ELITE_VOLTAGE * 1000LL, PROFILE_RATE },
+};
+
+#define PROFILE_BUILTIN_COUNT	((int) (sizeof(profile_builtin) / sizeof(profile_builtin[0])))
+
+static inline void profile_table_init(struct profile_table *t)
+{
+	memcpy(t->profiles, profile_builtin, sizeof(profile_builtin));
+	t->count = PROFILE_BUILTIN_COUNT;
+}
+
+static inline struct device_profile *profile_find(struct profile_table *t, const char *name)
+{
+	int i;
+
+	for (i = 0; i < t->count; i++)
+		if (strcmp(t->profiles[i].name, name) == 0)
+			return &t->profiles[i];
+	return NULL;
+}
+
+// Set one key of profile p.  Returns -1 for an unknown key or a bad value.
+static inline int profile_set(struct device_profile *p, const char *key, const char *value)
+{
+	char *end;
+	long v;
+
+	if (strcmp(key, "checksum") == 0) {
+		if (strcmp(value, "sum") == 0)
+			p->checksum = CHECKSUM_SUM;
+		else if (strcmp(value, "none") == 0)
+			p->checksum = CHECKSUM_NONE;
+		else
+			return -1;
+		return 0;
+	}
+	if (strcmp(key, "voltage") == 0) {
+		p->voltage = strtod(value, &end);
+		p->voltage_milli = (long long) (p->voltage * 1000 + (p->voltage < 0 ? -0.5 : 0.5));
+		return (*end == '\0' && end != value) ? 0 : -1;
+	}
+
+	v = strtol(value, &end, 0);
+	if (*end != '\0' || end == value || v < 0)
+		return -1;
+	if (strcmp(key, "minlowbit") == 0)
+		p->minlowbit = v;
+	else if (strcmp(key, "minhighbit") == 0)
+		p->minhighbit = v;
+	else if (strcmp(key, "preamble") == 0)
+		p->preamble = v;
+	else if (strcmp(key, "rate") == 0) {
+		if (v == 0)
+			return -1;
+		p->rate = v;
+	}
+	else if (strcmp(key, "bytecount") == 0) {
+		/* the watt calculation needs bytes 4-6 and a checksum byte after them */
+		if (v < 8 || v > PROFILE_MAX_BYTES)
+			return -1;
+		p->bytecount = v;
+	} else
+		return -1;
+	return 0;
+}
+
+// A threshold of n samples at rate from, as a threshold at rate to.  The decoder counts a
+// pulse from 0 at its first sample, so "more than n" means pulses of n + 2 samples or
+// more and the boundary lies at n + 1.5 samples.  The result is the threshold whose
+// boundary comes closest to the same length of time.
+static inline int profile_scale(int n, long from, long to)
+{
+	int v = (int) (((2LL * n + 3) * to) / (2LL * from)) - 1;
+
+	return (v < 0) ? 0 : v;
+}
+
+// Copy of profile src with its thresholds converted to rate samples per second
+static inline void profile_at_rate(struct device_profile *dst, const struct device_profile *src, long rate)
+{
+	*dst = *src;
+	dst->minlowbit = profile_scale(src->minlowbit, src->rate, rate);
+	dst->minhighbit = profile_scale(src->minhighbit, src->rate, rate);
+	dst->preamble = profile_scale(src->preamble, src->rate, rate);
+	dst->rate = rate;
+}
+
+// Strip leading and trailing blanks in place
+static inline char *profile_trim(char *s)
+{
+	char *e;
+
+	while (isspace((unsigned char) *s))
+		s++;
+	e = s + strlen(s);
+	while (e > s && isspace((unsigned char) e[-1]))
+		*--e = '\0';
+	return s;
+}
+
+// Add the profiles of a config file to the table.  Problems are reported on stderr with
+// the file name and line number.  Returns -1 if the file can't be read or has errors.
+static inline int profile_load(struct profile_table *t, const char *name)
+{
+	struct device_profile *p = NULL;
+	char line[256];
+	char *s, *eq, *hash;
+	int lineno = 0;
+	int errors = 0;
+	FILE *f;
+
+	f = fopen(name, "r");
+	if (f == NULL) {
+		perror(name);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		hash = strchr(line, '#');
+		if (hash != NULL)
+			*hash = '\0';
+		s = profile_trim(line);
+		if (*s == '\0')
+			continue;
+
+		if (*s == '[') {
+			eq = strchr(s, ']');
+			if (eq == NULL || eq - s - 1 >= PROFILE_NAME_MAX || eq == s + 1) {
+				fprintf(stderr, "%s:%d: bad profile name\n", name, lineno);
+				errors++;
+				p = NULL;
+				continue;
+			}
+			*eq = '\0';
+			p = profile_find(t, s + 1);
+			if (p == NULL) {
+				if (t->count == PROFILE_MAX) {
+					fprintf(stderr, "%s:%d: too many profiles\n", name, lineno);
+					errors++;
+					p = NULL;
+					continue;
+				}
+				p = &t->profiles[t->count++];
+			}
+			*p = profile_builtin[0];	/* start from the E2 Classic values */
+			strcpy(p->name, s + 1);
+			continue;
+		}
+
+		eq = strchr(s, '=');
+		if (p == NULL || eq == NULL) {
+			fprintf(stderr, "%s:%d: expected [profile] or key = value\n", name, lineno);
+			errors++;
+			continue;
+		}
+		*eq = '\0';
+		if (profile_set(p, profile_trim(s), profile_trim(eq + 1)) < 0) {
+			fprintf(stderr, "%s:%d: bad setting '%s'\n", name, lineno, profile_trim(s));
+			errors++;
+		}
+	}
+	fclose(f);
+	return errors ? -1 : 0;
+}
+
+#endif /* EFERGY_PROFILE_H */
@@ -0,0 +1,380 @@
+// efergy_reader.h - Block based sample reader for rtl_fm output
+//
+// rtl_fm writes a stream of signed 16 bit little endian samples.  Reading them
+// back two bytes at a time with fgetc() costs a pair of locked libc calls per
+// sample, which adds up to ~200k calls per second at -r 96000.  This reader pulls
+// READER_BLOCK_BYTES at a time with read(2) into an aligned buffer and hands the
+// decoder whole spans of int16_t samples instead.
+//
+// Usage:
+//
+//	struct sample_reader reader;
+//	size_t count, n;
+//
+//	if (sample_reader_open(&reader, STDIN_FILENO) < 0) ...
+//	while ((count = sample_reader_fill(&reader)) > 0)
+//		for (n = 0; n < count; n++)
+//			... reader.buf[n] ...
+//	sample_reader_close(&reader);
+//
+// Code that wants one sample at a time (e.g. the analysis mode) can use
+// sample_reader_next() instead, which only refills when the block runs out.
+// The two styles should not be mixed on the same reader.
+//
+// After sample_reader_set_iq() the reader expects raw cu8 IQ from rtl_sdr instead of
+// rtl_fm output, and demodulates it with efergy_fm.h before handing out samples.
+//
+// sample_reader_open_files() replays recorded captures instead of reading a stream.  The
+// files are mmap()ed one after the other and buf points straight into the mapping, so
+// nothing is copied and the decoder runs as fast as the disk (or page cache) allows.
+// Blocks are still at most READER_BLOCK_BYTES long.
+//
+// After sample_reader_nonblock() a read that would block ends the fill early: it returns
+// 0 with r->eof still clear, and the caller tries again once poll(2) says the fd is
+// readable.  That way one thread can take turns reading several streams.  The flag is
+// kept by the open file, which stdin shares with the shell and the other end of a pipe
+// with rtl_fm, so sample_reader_close() puts back the flags the fd had before.
+//
+// sample_reader_set_decimation() averages every few samples into one, which turns a
+// capture recorded at -r 96000 into what rtl_fm would have handed over at a lower rate.
+// It is meant for measuring how well the decoder does at lower rates on existing
+// recordings; a live receiver is better off running rtl_fm at the lower rate itself.
+//
+#ifndef EFERGY_READER_H
+#define EFERGY_READER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "efergy_fm.h"
+
+#define READER_BLOCK_BYTES	65536	/* Bytes requested from read(2) per block */
+#define READER_ALIGN		64	/* Buffer alignment, one cache line */
+
+struct sample_reader {
+	int fd;			/* Input file descriptor, usually stdin */
+	int16_t *buf;		/* Samples of the current block */
+	size_t count;		/* Number of valid samples in buf */
+	size_t pos;		/* Next sample handed out by sample_reader_next() */
+	size_t carry;		/* Odd byte left over from a short read (0 or 1) */
+	int eof;		/* Set once read(2) reports end of file or an error */
+	int fdflags;		/* Flags of fd before sample_reader_nonblock(), -1 if untouched */
+	struct fm_demod *fm;	/* Non NULL when the input is raw IQ */
+	unsigned char *iq;	/* Raw IQ bytes read from fd */
+	int16_t *block;		/* Buffer owned by the reader, buf points here unless replaying */
+	char **files;		/* Captures still to replay, NULL when reading fd */
+	int nfiles;
+	const unsigned char *map;	/* Capture being replayed */
+	size_t mapsize;
+	size_t mappos;		/* Next byte of the mapping to hand out */
+	int decimation;		/* Samples averaged into one, 1 for none */
+	int32_t acc;		/* Sum of the samples of a partial average */
+	int accn;		/* Samples in acc so far */
+	int16_t *out;		/* Averaged samples, buf points here when decimating */
+	int16_t *raw;		/* buf and count of the last block read, before averaging */
+	size_t rawcount;
+};
+
+static inline int sample_reader_open(struct sample_reader *r, int fd)
+{
+	void *mem;
+
+	r->fd = fd;
+	r->count = 0;
+	r->pos = 0;
+	r->carry = 0;
+	r->eof = 0;
+	r->fdflags = -1;
+	r->fm = NULL;
+	r->iq = NULL;
+	r->files = NULL;
+	r->nfiles = 0;
+	r->map = NULL;
+	r->mapsize = 0;
+	r->mappos = 0;
+	r->decimation = 1;
+	r->acc = 0;
+	r->accn = 0;
+	r->out = NULL;
+	/* One spare byte at the end is enough room to hold a carried odd byte */
+	if (posix_memalign(&mem, READER_ALIGN, READER_BLOCK_BYTES + READER_ALIGN) != 0)
+		return -1;
+	r->buf = (int16_t *) mem;
+	r->block = r->buf;
+	r->raw = r->buf;
+	r->rawcount = 0;
+	return 0;
+}
+
+// Replay nfiles recorded captures, in order, instead of reading a stream
+static inline int sample_reader_open_files(struct sample_reader *r, char **files, int nfiles)
+{
+	if (sample_reader_open(r, -1) < 0)
+		return -1;
+	r->files = files;
+	r->nfiles = nfiles;
+	return 0;
+}
+
+// Switch the reader to raw IQ input demodulated by fm.  Returns -1 if out of memory.
+static inline int sample_reader_set_iq(struct sample_reader *r, struct fm_demod *fm)
+{
+	void *mem;
+
+	if (posix_memalign(&mem, READER_ALIGN, READER_BLOCK_BYTES) != 0)
+		return -1;
+	r->iq = (unsigned char *) mem;
+	r->fm = fm;
+	return 0;
+}
+
+// Average every factor samples into one.  Returns -1 if out of memory.
+static inline int sample_reader_set_decimation(struct sample_reader *r, int factor)
+{
+	void *mem;
+
+	if (factor <= 1)
+		return 0;
+	if (posix_memalign(&mem, READER_ALIGN, READER_BLOCK_BYTES / 2) != 0)
+		return -1;
+	r->out = (int16_t *) mem;
+	r->decimation = factor;
+	return 0;
+}
+
+// Don't wait for input that isn't there yet, see above.  Returns -1 on error.
+static inline int sample_reader_nonblock(struct sample_reader *r)
+{
+	int flags = fcntl(r->fd, F_GETFL);
+
+	if (flags < 0 || fcntl(r->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	r->fdflags = flags;
+	return 0;
+}
+
+// Free the buffers.  The fd is left open, with the flags it had before.
+static inline void sample_reader_close(struct sample_reader *r)
+{
+	if (r->fdflags >= 0)
+		fcntl(r->fd, F_SETFL, r->fdflags);
+	r->fdflags = -1;
+	if (r->map != NULL)
+		munmap((void *) r->map, r->mapsize);
+	r->map = NULL;
+	free(r->block);
+	free(r->iq);
+	free(r->out);
+	r->block = NULL;
+	r->buf = NULL;
+	r->iq = NULL;
+	r->out = NULL;
+	r->count = 0;
+}
+
+// IQ input: every block of raw bytes is demodulated straight into r->buf
+static inline size_t sample_reader_fill_iq(struct sample_reader *r)
+{
+	ssize_t got;
+
+	r->count = 0;
+	r->pos = 0;
+	while (!r->eof && r->count == 0) {
+		got = read(r->fd, r->iq, READER_BLOCK_BYTES);
+		if (got > 0)
+			r->count = fm_demod_process(r->fm, r->iq, got, r->buf);
+		else if (got < 0 && errno == EINTR)
+			continue;
+		else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		else
+			r->eof = 1;
+	}
+	return r->count;
+}
+
+// Map the next capture to replay.  Returns 0 when there are none left.  Files that
+// cannot be opened or are empty are reported and skipped.
+static inline int sample_reader_map_next(struct sample_reader *r)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (r->map != NULL)
+		munmap((void *) r->map, r->mapsize);
+	r->map = NULL;
+	r->mapsize = 0;
+	r->mappos = 0;
+
+	while (r->nfiles > 0) {
+		fd = open(r->files[0], O_RDONLY);
+		if (fd < 0) {
+			perror(r->files[0]);
+		} else {
+			map = MAP_FAILED;
+			if (fstat(fd, &st) == 0 && st.st_size > 0)
+				map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (map != MAP_FAILED) {
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+				r->map = (const unsigned char *) map;
+				r->mapsize = st.st_size;
+			}
+		}
+		r->files++;
+		r->nfiles--;
+		if (r->map != NULL)
+			return 1;
+	}
+	return 0;
+}
+
+// Replay: hand out the next piece of the mapped captures
+static inline size_t sample_reader_fill_map(struct sample_reader *r)
+{
+	const unsigned char *bytes;
+	size_t len;
+	size_t i;
+
+	r->count = 0;
+	r->pos = 0;
+	while (!r->eof && r->count == 0) {
+		if (r->mappos >= r->mapsize) {
+			if (!sample_reader_map_next(r))
+				r->eof = 1;
+			continue;
+		}
+		bytes = r->map + r->mappos;
+		len = r->mapsize - r->mappos;
+		if (len > READER_BLOCK_BYTES)
+			len = READER_BLOCK_BYTES;
+		r->mappos += len;
+
+		if (r->fm) {
+			r->buf = r->block;
+			r->count = fm_demod_process(r->fm, bytes, len, r->buf);
+			continue;
+		}
+
+		/* a trailing odd byte in a capture is dropped */
+		r->count = len / 2;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+		r->buf = r->block;
+		for (i = 0; i < r->count; i++)
+			r->buf[i] = (int16_t) (bytes[2*i] | (bytes[2*i+1] << 8));
+#else
+		(void) i;
+		r->buf = (int16_t *) bytes;
+#endif
+	}
+	return r->count;
+}
+
+// Read the next block of samples, as they come, into r->buf
+static inline size_t sample_reader_fill_raw(struct sample_reader *r)
+{
+	unsigned char *bytes = (unsigned char *) r->buf;
+	size_t have;
+	ssize_t got;
+	size_t i;
+
+	if (r->files)
+		return sample_reader_fill_map(r);
+	if (r->fm)
+		return sample_reader_fill_iq(r);
+
+	if (r->carry)
+		bytes[0] = bytes[r->count * 2];
+	have = r->carry;
+	r->count = 0;
+	r->pos = 0;
+
+	while (!r->eof && have < 2) {
+		got = read(r->fd, bytes + have, READER_BLOCK_BYTES - have);
+		if (got > 0)
+			have += got;
+		else if (got < 0 && errno == EINTR)
+			continue;
+		else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		else
+			r->eof = 1;
+	}
+
+	r->count = have / 2;
+	r->carry = have & 1;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	for (i = 0; i < r->count; i++)
+		r->buf[i] = (int16_t) (bytes[2*i] | (bytes[2*i+1] << 8));
+#else
+	(void) i;
+#endif
+	return r->count;
+}
+
+// Average the block just read into r->out.  A partial average is carried over to the
+// next block.
+static inline size_t sample_reader_decimate(struct sample_reader *r)
+{
+	const int16_t *in = r->buf;
+	size_t n = 0;
+	size_t i;
+
+	for (i = 0; i < r->count; i++) {
+		r->acc += in[i];
+		if (++r->accn == r->decimation) {
+			r->out[n++] = (int16_t) (r->acc / r->decimation);
+			r->acc = 0;
+			r->accn = 0;
+		}
+	}
+	return n;
+}
+
+// Read the next block of samples into r->buf.  Returns the number of samples
+// available, or 0 at end of file (or when a non-blocking fd has nothing yet, r->eof
+// tells them apart).  Samples from the previous block are gone once this is called.
+static inline size_t sample_reader_fill(struct sample_reader *r)
+{
+	size_t n;
+
+	if (r->decimation == 1)
+		return sample_reader_fill_raw(r);
+
+	/* the raw reads carry their odd byte at the end of the previous raw block */
+
+	for (;;) {
+		r->buf = r->raw;
+		r->count = r->rawcount;
+		n = sample_reader_fill_raw(r);
+		r->raw = r->buf;
+		r->rawcount = r->count;
+		if (n == 0)
+			return 0;
+		n = sample_reader_decimate(r);
+		if (n > 0) {
+			r->buf = r->out;
+			r->count = n;
+			r->pos = 0;
+			return n;
+		}
+	}
+}
+
+// Fetch a single sample.  Returns 1 and stores the sample in *samp, or 0 at end of file.
+static inline int sample_reader_next(struct sample_reader *r, int *samp)
+{
+	if (r->pos == r->count && sample_reader_fill(r) == 0)
+		return 0;
+	*samp = r->buf[r->pos++];
+	return 1;
+}
+
+#endif /* EFERGY_READER_H */
@@ -0,0 +1,184 @@
+// efergy_slicer.h - Vectorized pulse slicer
+//
+// Both the decoder and the analysis code only care about how many consecutive samples
+// sit above or below the wave center.  slicer_process() turns a block of samples into
+// a compact list of runs, each one a class (above, equal to or below center) and the
+// number of samples in it, so the frame state machine runs once per pulse instead of
+// once per sample.
+//
+// The kernel compares 8 (SSE2, NEON) or 16 (AVX2) samples at a time against the center,
+// turns the comparison results into bit masks and walks only the bits where the class
+// changes.  The path is picked at build time from the compiler's target flags
+// (e.g. -msse2, -mavx2, -mfpu=neon or simply -march=native).  Build with -DSLICER_SCALAR
+// to force the plain C reference, which every other path must match exactly.
+//
+// Only completed runs are reported.  The run still in progress at the end of a block
+// is kept in the slicer and continues into the next block, so runs never get split at
+// block boundaries.
+//
+#ifndef EFERGY_SLICER_H
+#define EFERGY_SLICER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if !defined(SLICER_SCALAR)
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#define SLICER_SSE2
+#if defined(__AVX2__)
+#define SLICER_AVX2
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SLICER_NEON
+#endif
+#endif
+
+#define SLICE_LOW	(-1)	/* Sample below center */
+#define SLICE_MID	0	/* Sample exactly at center */
+#define SLICE_HIGH	1	/* Sample above center */
+
+struct slicer_run {
+	int32_t sign;		/* SLICE_LOW, SLICE_MID or SLICE_HIGH */
+	uint32_t len;		/* Number of consecutive samples of that class */
+};
+
+struct slicer {
+	int center;		/* Wave center the samples are compared against */
+	int32_t sign;		/* Class of the run in progress */
+	uint32_t len;		/* Samples in the run in progress, 0 before the first sample */
+};
+
+static inline int32_t slicer_class(int samp, int center)
+{
+	return (samp > center) - (samp < center);
+}
+
+// Start slicing against center.  If prvsamp is not NULL, the run in progress starts
+// with that sample (i.e. the last sample seen before the next block).
+static inline void slicer_init(struct slicer *s, long center, const int16_t *prvsamp)
+{
+	s->center = (int) center;
+	s->len = 0;
+	s->sign = SLICE_MID;
+	if (prvsamp != NULL) {
+		s->sign = slicer_class(*prvsamp, s->center);
+		s->len = 1;
+	}
+}
+
+// Plain C reference.  Returns the number of runs written to runs[].
+static inline size_t slicer_process_scalar(struct slicer *s, const int16_t *samp, size_t n, struct slicer_run *runs)
+{
+	size_t nruns = 0;
+	size_t i;
+	int32_t sign;
+
+	for (i = 0; i < n; i++) {
+		sign = slicer_class(samp[i], s->center);
+		if (sign != s->sign && s->len > 0) {
+			runs[nruns].sign = s->sign;
+			runs[nruns].len = s->len;
+			nruns++;
+			s->len = 0;
+		}
+		s->sign = sign;
+		s->len++;
+	}
+	return nruns;
+}
+
+#if defined(SLICER_SSE2) || defined(SLICER_NEON)
+// Walk the class changes of one vector of samples.  gt and lt hold comparison masks
+// with `stride` identical bits per sample, lane 0 in the lowest bits.
+static inline size_t slicer_walk(struct slicer *s, uint64_t gt, uint64_t lt, int lanes, int stride, struct slicer_run *runs)
+{
+	const uint64_t lane = ((uint64_t) 1 << stride) - 1;
+	uint64_t trans;
+	size_t nruns = 0;
+	int start = 0;
+	int j;
+
+	/* a lane starts a new run if its class differs from the lane before it */
+	trans  = gt ^ ((gt << stride) | ((s->sign == SLICE_HIGH) ? lane : 0));
+	trans |= lt ^ ((lt << stride) | ((s->sign == SLICE_LOW) ? lane : 0));
+	if (lanes * stride < 64)
+		trans &= ((uint64_t) 1 << (lanes * stride)) - 1;
+
+	while (trans) {
+		j = __builtin_ctzll(trans) / stride;
+		runs[nruns].sign = s->sign;
+		runs[nruns].len = s->len + (j - start);
+		nruns++;
+		s->len = 0;
+		start = j;
+		if ((gt >> (j * stride)) & 1)
+			s->sign = SLICE_HIGH;
+		else if ((lt >> (j * stride)) & 1)
+			s->sign = SLICE_LOW;
+		else
+			s->sign = SLICE_MID;
+		trans &= ~(lane << (j * stride));
+	}
+	s->len += lanes - start;
+	return nruns;
+}
+#endif
+
+// Slice n samples into runs[], which must have room for n runs.  Returns the number
+// of completed runs.
+static inline size_t slicer_process(struct slicer *s, const int16_t *samp, size_t n, struct slicer_run *runs)
+{
+	size_t nruns = 0;
+	size_t i = 0;
+
+	if (n == 0)
+		return 0;
+	if (s->len == 0) {
+		/* very first sample, there is no previous class to compare with */
+		s->sign = slicer_class(samp[0], s->center);
+		s->len = 1;
+		i = 1;
+	}
+
+#if defined(SLICER_AVX2)
+	{
+		const __m256i c = _mm256_set1_epi16((int16_t) s->center);
+		for (; i + 16 <= n; i += 16) {
+			__m256i v = _mm256_loadu_si256((const __m256i *) (samp + i));
+			uint32_t gt = _mm256_movemask_epi8(_mm256_cmpgt_epi16(v, c));
+			uint32_t lt = _mm256_movemask_epi8(_mm256_cmpgt_epi16(c, v));
+			nruns += slicer_walk(s, gt, lt, 16, 2, runs + nruns);
+		}
+	}
+#endif
+#if defined(SLICER_SSE2)
+	{
+		const __m128i c = _mm_set1_epi16((int16_t) s->center);
+		for (; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *) (samp + i));
+			uint32_t gt = _mm_movemask_epi8(_mm_cmpgt_epi16(v, c));
+			uint32_t lt = _mm_movemask_epi8(_mm_cmplt_epi16(v, c));
+			nruns += slicer_walk(s, gt, lt, 8, 2, runs + nruns);
+		}
+	}
+#elif defined(SLICER_NEON)
+	{
+		const int16x8_t c = vdupq_n_s16((int16_t) s->center);
+		for (; i + 8 <= n; i += 8) {
+			int16x8_t v = vld1q_s16(samp + i);
+			/* narrow each 16 bit lane mask to 8 bits, giving one byte per sample */
+			uint64_t gt = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(vcgtq_s16(v, c))), 0);
+			uint64_t lt = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(vcltq_s16(v, c))), 0);
+			nruns += slicer_walk(s, gt, lt, 8, 8, runs + nruns);
+		}
+	}
+#endif
+
+	if (i < n)
+		nruns += slicer_process_scalar(s, samp + i, n - i, runs + nruns);
+	return nruns;
+}
+
+#endif /* EFERGY_SLICER_H */
@@ -0,0 +1,163 @@
+// efergy_stamp.h - Cached reading timestamps
+//
+// Every reading used to get time(), localtime() (which may go and stat /etc/localtime)
+// and strftime("%x,%X") of its own.  When a corpus is replayed at millions of frames, or
+// a dozen meters report within the same second, that is the same string worked out over
+// and over.  The cache keeps the formatted "date,time" text.  The date part is only
+// formatted again when the day changes, and localtime() only runs once per local hour:
+// within the hour the minutes and seconds are updated in place.
+//
+// Usage:
+//
+//	struct stamp_cache stamp;
+//	struct stamp_clock clock;
+//	struct timespec now;
+//
+//	stamp_cache_init(&stamp, 0);		(or 3 / 6 for milli / microseconds)
+//	stamp_clock_init(&clock);
+//	stamp_clock_now(&clock, &now);
+//	printf("%s,%f\n", stamp_format(&stamp, now.tv_sec, now.tv_nsec), watts);
+//
+// The time of day is only patched in place when the locale's %X is plain HH:MM:SS, as it
+// is in the C locale.  Otherwise strftime() still runs once per second.  The hour is
+// assumed to start on a whole hour of local time, which is where daylight saving
+// changes happen.
+//
+#ifndef EFERGY_STAMP_H
+#define EFERGY_STAMP_H
+
+#include <string.h>
+#include <time.h>
+
+#define STAMP_MAX		80
+
+struct stamp_cache {
+	time_t hour;		/* Local start of the cached hour, -1 if none */
+	time_t second;		/* Second the text is for, -1 if none */
+	int year;		/* Day the date part is for */
+	int yday;
+	int timepos;		/* Where the time of day starts in text */
+	int len;		/* Length of "date,time" without the fraction */
+	int plain;		/* %X is HH:MM:SS, so the time can be patched in place */
+	int subsec;		/* Digits of fraction after the seconds, 0 for none */
+	char text[STAMP_MAX];
+};
+
+// Clock for reading timestamps.  Time advances with CLOCK_MONOTONIC from the wall clock
+// read at the last resync, so a step of the wall clock doesn't show up in the middle of a
+// burst of readings.  It is resynced every STAMP_RESYNC seconds so it still follows the
+// wall clock, e.g. on a Raspberry Pi without a real time clock that only gets the right
+// time from NTP after the logger started.
+#define STAMP_RESYNC		60
+
+struct stamp_clock {
+	struct timespec real;	/* Wall clock at the last resync */
+	struct timespec mono;	/* Monotonic clock at the last resync */
+};
+
+// subsec is the number of digits of fraction to print, 0 to 9
+static inline void stamp_cache_init(struct stamp_cache *c, int subsec)
+{
+	c->hour = -1;
+	c->second = -1;
+	c->year = -1;
+	c->yday = -1;
+	c->timepos = 0;
+	c->len = 0;
+	c->plain = 0;
+	c->subsec = (subsec < 0) ? 0 : (subsec > 9) ? 9 : subsec;
+	c->text[0] = '\0';
+}
+
+static inline void stamp_put2(char *p, int v)
+{
+	p[0] = '0' + v / 10;
+	p[1] = '0' + v % 10;
+}
+
+// Work out the text for second t from scratch
+static inline void stamp_refresh(struct stamp_cache *c, time_t t)
+{
+	struct tm tm;
+	char *tp;
+	int n;
+
+	localtime_r(&t, &tm);
+	if (tm.tm_year != c->year || tm.tm_yday != c->yday) {
+		n = strftime(c->text, STAMP_MAX - 1, "%x,", &tm);
+		c->timepos = n;
+		c->year = tm.tm_year;
+		c->yday = tm.tm_yday;
+	}
+	tp = c->text + c->timepos;
+	n = strftime(tp, STAMP_MAX - 12 - c->timepos, "%X", &tm);
+	c->len = c->timepos + n;
+
+	/* can the minutes and seconds be patched from now on? */
+
+	c->plain = (n == 8 && tp[2] == ':' && tp[5] == ':' && tp[0] == '0' + tm.tm_hour / 10 &&
+		tp[1] == '0' + tm.tm_hour % 10);
+	c->hour = c->plain ? t - tm.tm_min * 60 - tm.tm_sec : -1;
+}
+
+// Text for second t with nsec nanoseconds, as "%x,%X" plus the fraction if asked for.  The
+// string stays valid until the next call.
+static inline const char *stamp_format(struct stamp_cache *c, time_t t, long nsec)
+{
+	long off, frac;
+	char *p;
+	int i;
+
+	if (t != c->second) {
+		off = (long) (t - c->hour);
+		if (c->hour >= 0 && off >= 0 && off < 3600) {
+			p = c->text + c->timepos;
+			stamp_put2(p + 3, off / 60);
+			stamp_put2(p + 6, off % 60);
+		} else
+			stamp_refresh(c, t);
+		c->second = t;
+		c->text[c->len] = '\0';
+	}
+	if (c->subsec > 0) {
+		p = c->text + c->len;
+		frac = nsec;
+		for (i = c->subsec; i < 9; i++)
+			frac /= 10;
+		p[0] = '.';
+		for (i = c->subsec; i > 0; i--) {
+			p[i] = '0' + frac % 10;
+			frac /= 10;
+		}
+		p[c->subsec + 1] = '\0';
+	}
+	return c->text;
+}
+
+static inline void stamp_clock_init(struct stamp_clock *k)
+{
+	clock_gettime(CLOCK_REALTIME, &k->real);
+	clock_gettime(CLOCK_MONOTONIC, &k->mono);
+}
+
+static inline void stamp_clock_now(struct stamp_clock *k, struct timespec *now)
+{
+	struct timespec mono;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	if (mono.tv_sec - k->mono.tv_sec >= STAMP_RESYNC) {
+		clock_gettime(CLOCK_REALTIME, &k->real);
+		k->mono = mono;
+	}
+	now->tv_sec = k->real.tv_sec + (mono.tv_sec - k->mono.tv_sec);
+	now->tv_nsec = k->real.tv_nsec + (mono.tv_nsec - k->mono.tv_nsec);
+	if (now->tv_nsec < 0) {
+		now->tv_nsec += 1000000000;
+		now->tv_sec--;
+	} else if (now->tv_nsec >= 1000000000) {
+		now->tv_nsec -= 1000000000;
+		now->tv_sec++;
+	}
+}
+
+#endif /* EFERGY_STAMP_H */
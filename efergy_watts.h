@@ -0,0 +1,87 @@
+// efergy_watts.h - Reading from the current ADC value and exponent
+//
+// A frame carries the current as a 16 bit ADC value (bytes 4-5) and a signed scaling
+// exponent (byte 6).  The reading is
+//
+//	voltage * adc / (32768 / 2^exponent)  =  voltage * adc * 2^(exponent - 15)
+//
+// which used to be worked out with pow() for every frame.  The 256 possible scale
+// factors are powers of two, so they are exact in a double and are simply looked up.
+// Multiplying by one gives bit for bit the same result as the division by
+// 32768 / pow(2, exponent) did, and nothing needs libm any more.
+//
+// watts_milli() gives the reading times 1000 as an integer without any floating point,
+// for soft-float ARM builds and logs that want integer values.  The voltage is given in
+// thousandths (see struct device_profile), the result is rounded to nearest and clamps
+// at the int64_t limits.
+//
+#ifndef EFERGY_WATTS_H
+#define EFERGY_WATTS_H
+
+#include <stdint.h>
+
+// 2^(exponent - 15) for every value of the exponent byte, read as signed char
+static const double watt_scale[256] = {
+	0x1p-15, 0x1p-14, 0x1p-13, 0x1p-12, 0x1p-11, 0x1p-10, 0x1p-9, 0x1p-8,	/* 00 */
+	0x1p-7, 0x1p-6, 0x1p-5, 0x1p-4, 0x1p-3, 0x1p-2, 0x1p-1, 0x1p0,	/* 08 */
+	0x1p1, 0x1p2, 0x1p3, 0x1p4, 0x1p5, 0x1p6, 0x1p7, 0x1p8,	/* 10 */
+	0x1p9, 0x1p10, 0x1p11, 0x1p12, 0x1p13, 0x1p14, 0x1p15, 0x1p16,	/* 18 */
+	0x1p17, 0x1p18, 0x1p19, 0x1p20, 0x1p21, 0x1p22, 0x1p23, 0x1p24,	/* 20 */
+	0x1p25, 0x1p26, 0x1p27, 0x1p28, 0x1p29, 0x1p30, 0x1p31, 0x1p32,	/* 28 */
+	0x1p33, 0x1p34, 0x1p35, 0x1p36, 0x1p37, 0x1p38, 0x1p39, 0x1p40,	/* 30 */
+	0x1p41, 0x1p42, 0x1p43, 0x1p44, 0x1p45, 0x1p46, 0x1p47, 0x1p48,	/* 38 */
+	0x1p49, 0x1p50, 0x1p51, 0x1p52, 0x1p53, 0x1p54, 0x1p55, 0x1p56,	/* 40 */
+	0x1p57, 0x1p58, 0x1p59, 0x1p60, 0x1p61, 0x1p62, 0x1p63, 0x1p64,	/* 48 */
+	0x1p65, 0x1p66, 0x1p67, 0x1p68, 0x1p69, 0x1p70, 0x1p71, 0x1p72,	/* 50 */
+	0x1p73, 0x1p74, 0x1p75, 0x1p76, 0x1p77, 0x1p78, 0x1p79, 0x1p80,	/* 58 */
+	0x1p81, 0x1p82, 0x1p83, 0x1p84, 0x1p85, 0x1p86, 0x1p87, 0x1p88,	/* 60 */
+	0x1p89, 0x1p90, 0x1p91, 0x1p92, 0x1p93, 0x1p94, 0x1p95, 0x1p96,	/* 68 */
+	0x1p97, 0x1p98, 0x1p99, 0x1p100, 0x1p101, 0x1p102, 0x1p103, 0x1p104,	/* 70 */
+	0x1p105, 0x1p106, 0x1p107, 0x1p108, 0x1p109, 0x1p110, 0x1p111, 0x1p112,	/* 78 */
+	0x1p-143, 0x1p-142, 0x1p-141, 0x1p-140, 0x1p-139, 0x1p-138, 0x1p-137, 0x1p-136,	/* 80 */
+	0x1p-135, 0x1p-134, 0x1p-133, 0x1p-132, 0x1p-131, 0x1p-130, 0x1p-129, 0x1p-128,	/* 88 */
+	0x1p-127, 0x1p-126, 0x1p-125, 0x1p-124, 0x1p-123, 0x1p-122, 0x1p-121, 0x1p-120,	/* 90 */
+	0x1p-119, 0x1p-118, 0x1p-117, 0x1p-116, 0x1p-115, 0x1p-114, 0x1p-113, 0x1p-112,	/* 98 */
+	0x1p-111, 0x1p-110, 0x1p-109, 0x1p-108, 0x1p-107, 0x1p-106, 0x1p-105, 0x1p-104,	/* a0 */
+	0x1p-103, 0x1p-102, 0x1p-101, 0x1p-100, 0x1p-99, 0x1p-98, 0x1p-97, 0x1p-96,	/* a8 */
+	0x1p-95, 0x1p-94, 0x1p-93, 0x1p-92, 0x1p-91, 0x1p-90, 0x1p-89, 0x1p-88,	/* b0 */
+	0x1p-87, 0x1p-86, 0x1p-85, 0x1p-84, 0x1p-83, 0x1p-82, 0x1p-81, 0x1p-80,	/* b8 */
+	0x1p-79, 0x1p-78, 0x1p-77, 0x1p-76, 0x1p-75, 0x1p-74, 0x1p-73, 0x1p-72,	/* c0 */
+	0x1p-71, 0x1p-70, 0x1p-69, 0x1p-68, 0x1p-67, 0x1p-66, 0x1p-65, 0x1p-64,	/* c8 */
+	0x1p-63, 0x1p-62, 0x1p-61, 0x1p-60, 0x1p-59, 0x1p-58, 0x1p-57, 0x1p-56,	/* d0 */
+	0x1p-55, 0x1p-54, 0x1p-53, 0x1p-52, 0x1p-51, 0x1p-50, 0x1p-49, 0x1p-48,	/* d8 */
+	0x1p-47, 0x1p-46, 0x1p-45, 0x1p-44, 0x1p-43, 0x1p-42, 0x1p-41, 0x1p-40,	/* e0 */
+	0x1p-39, 0x1p-38, 0x1p-37, 0x1p-36, 0x1p-35, 0x1p-34, 0x1p-33, 0x1p-32,	/* e8 */
+	0x1p-31, 0x1p-30, 0x1p-29, 0x1p-28, 0x1p-27, 0x1p-26, 0x1p-25, 0x1p-24,	/* f0 */
+	0x1p-23, 0x1p-22, 0x1p-21, 0x1p-20, 0x1p-19, 0x1p-18, 0x1p-17, 0x1p-16,	/* f8 */
+};
+
+static inline double watts_calc(double voltage, unsigned int adc, unsigned char exponent)
+{
+	return (voltage * (double) adc) * watt_scale[exponent];
+}
+
+// Reading times 1000, from the voltage times 1000
+static inline int64_t watts_milli(int64_t voltage_milli, unsigned int adc, unsigned char exponent)
+{
+	uint64_t v;
+	int shift = (signed char) exponent - 15;
+	int neg = voltage_milli < 0;
+
+	v = (uint64_t) (neg ? -voltage_milli : voltage_milli) * adc;
+	if (v == 0)
+		return 0;
+	if (shift >= 0) {
+		if (shift >= 63 || v > ((uint64_t) INT64_MAX >> shift))
+			v = INT64_MAX;
+		else
+			v <<= shift;
+	} else if (shift > -64) {
+		/* round half away from zero */
+		v = (v >> -shift) + ((v >> (-shift - 1)) & 1);
+	} else
+		v = 0;
+	return neg ? -(int64_t) v : (int64_t) v;
+}
+
+#endif /* EFERGY_WATTS_H */
@@ -0,0 +1,481 @@
+// efergy_writer.h - Asynchronous log writer
+//
+// Formatting a reading and writing it to stdout and the log file used to happen right in
+// the decode loop, so a slow SD card write stalled sample consumption until rtl_fm's pipe
+// filled up.  Now the decode loop only drops a small record into a single producer /
+// single consumer ring and carries on.  A writer thread formats the records and hands
+// each batch to write(2) in one go.
+//
+// Usage:
+//
+//	struct log_writer writer;
+//
+//	struct log_reading rd;
+//
+//	if (log_writer_open(&writer, logfd, binfd, SAMPLES_TO_FLUSH, LOGTYPE) < 0) ...
+//	rd.time = time(NULL); ...; log_writer_push(&writer, &rd);	(decode thread)
+//	log_writer_close(&writer);
+//
+// Lines go to stdout as soon as the writer wakes up.  Lines for the log file, and records
+// for the binary log (efergy_binlog.h), are held back until flush_every readings have
+// collected, which is what SAMPLES_TO_FLUSH used to mean for fflush(), and whatever is
+// left is written on close.  The decode loop never
+// waits: if the ring is full the reading is dropped and counted in writer.dropped.  When
+// replaying captures faster than real time set writer.wait, so the decode loop waits for
+// room instead and no reading is lost.
+//
+// The readings go to whichever sinks were chosen at startup: stdout (writer.outfd, -1 to
+// leave it out), the CSV log and the binary log given to log_writer_open(), per
+// transmitter logs (log_writer_split()) and a datagram socket from log_socket_open()
+// (writer.sockfd), which gets every line as a datagram of its own as soon as the writer
+// wakes up, for a collector on the network.  A datagram that can't be sent right away is
+// not retried, it is counted in writer.unsent.  Checksum errors only go to stdout.
+//
+// Set writer.tag to put each reading's transmitter id in its line, writer.subsec to give
+// the time a fraction of a second with that many digits, writer.integer to print readings
+// as integer milliwatts without any floating point, and call log_writer_split() to
+// give every transmitter (see efergy_meter.h) a log file of its own instead of one shared
+// log.  These go between log_writer_open() and the first push.  Readings of repaired
+// frames get ",corrected" after the value.  Timestamps are formatted
+// through a cache (see efergy_stamp.h), so readings in the same second share the work.
+//
+// Other slow work the decode loop shouldn't wait for, like saving the learned thresholds,
+// can be handed to the writer thread with log_writer_job().  It runs once the readings
+// queued so far are written.  There is only room for one job at a time.
+//
+// Link with -lpthread.
+//
+#ifndef EFERGY_WRITER_H
+#define EFERGY_WRITER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include "efergy_binlog.h"
+#include "efergy_meter.h"
+#include "efergy_stamp.h"
+
+#define WRITER_RING_SIZE	256	/* Readings the ring can hold, must be a power of 2 */
+#define WRITER_LINE_MAX		128	/* Longest formatted line */
+
+struct log_reading {
+	time_t time;		/* When the frame was decoded */
+	long nsec;		/* and the nanoseconds */
+	uint32_t id;		/* Transmitter id */
+	uint16_t adc;		/* Raw current ADC value */
+	int8_t exponent;	/* Scaling exponent */
+	double watts;		/* Calculated reading */
+	int64_t milliwatts;	/* The same times 1000, see efergy_watts.h */
+	int valid;		/* 0 if the frame failed its checksum */
+	int corrected;		/* A bit was flipped to make the checksum match */
+	int meter;		/* Index in the meter table, or -1 */
+};
+
+// Log file of one transmitter when the log is split
+struct log_writer_meter {
+	int fd;			/* -1 until the first reading, or if it can't be opened */
+	int failed;		/* Don't try to open it again */
+	size_t len;
+	char *buf;		/* Lines waiting to be written */
+};
+
+struct log_writer {
+	struct log_reading ring[WRITER_RING_SIZE];
+	unsigned int head;	/* Next slot the decode thread fills */
+	unsigned int tail;	/* Next slot the writer thread drains */
+	unsigned long dropped;	/* Readings lost because the ring was full */
+	unsigned long unsent;	/* Datagrams that couldn't be sent */
+	int stop;		/* Set by log_writer_close() */
+	int busy;		/* job is waiting or running, see log_writer_job() */
+	void (*job)(void *arg);
+	void *job_arg;
+	int wait;		/* Wait for room instead of dropping when the ring is full */
+	sem_t wake;		/* Posted once per pushed reading */
+	pthread_t thread;
+	int outfd;		/* Lines as they come, stdout unless set to -1 */
+	int sockfd;		/* Datagram socket for the lines, or -1 */
+	int logfd;		/* Log file, or -1 for stdout only */
+	int binfd;		/* Binary log from binlog_open(), or -1 */
+	int crlf;		/* Log lines end in \r\n instead of \n */
+	int tag;		/* Lines carry the transmitter id */
+	int subsec;		/* Digits of fraction of a second in the time */
+	int integer;		/* Print milliwatts as integers instead of watts */
+	const char *splitname;	/* Per transmitter logs are named after this, or NULL */
+	struct log_writer_meter *meterlogs;	/* METER_MAX of them when split */
+	int flush_every;	/* Readings collected before the log file is written */
+	int logcount;		/* Readings waiting in logbuf */
+	size_t loglen;
+	char *logbuf;
+	struct binlog_block *binbuf;	/* Binary records waiting to be written */
+};
+
+// write(2) all of buf, retrying on short writes and EINTR
+static inline void log_writer_write(int fd, const char *buf, size_t len)
+{
+	ssize_t done;
+
+	while (len > 0) {
+		done = write(fd, buf, len);
+		if (done < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		buf += done;
+		len -= done;
+	}
+}
+
+// Write out the readings collected for the log files
+static inline void log_writer_flush(struct log_writer *w)
+{
+	struct log_writer_meter *ml;
+	int i;
+
+	if (w->logfd >= 0)
+		log_writer_write(w->logfd, w->logbuf, w->loglen);
+	for (i = 0; w->meterlogs != NULL && i < METER_MAX; i++) {
+		ml = &w->meterlogs[i];
+		if (ml->fd >= 0)
+			log_writer_write(ml->fd, ml->buf, ml->len);
+		ml->len = 0;
+	}
+	if (w->binfd >= 0)
+		log_writer_write(w->binfd, (const char *) w->binbuf->buf, binlog_block_seal(w->binbuf));
+	w->loglen = 0;
+	w->logcount = 0;
+}
+
+// Log file for the meter of rd, opened the first time it is needed.  The name is the
+// split name with the transmitter id put in front of the extension, efergy.csv becomes
+// efergy-0912a4b0.csv.  Returns NULL if it can't be opened.
+static inline struct log_writer_meter *log_writer_meter(struct log_writer *w, const struct log_reading *rd)
+{
+	struct log_writer_meter *ml;
+	const char *dot, *slash;
+	char name[4096];
+	int len;
+
+	if (rd->meter < 0 || rd->meter >= METER_MAX)
+		return NULL;
+	ml = &w->meterlogs[rd->meter];
+	if (ml->fd >= 0)
+		return ml;
+	if (ml->failed)
+		return NULL;
+
+	dot = strrchr(w->splitname, '.');
+	slash = strrchr(w->splitname, '/');
+	if (dot == NULL || (slash != NULL && dot < slash) || dot == w->splitname)
+		dot = w->splitname + strlen(w->splitname);
+	len = snprintf(name, sizeof(name), "%.*s-%08x%s", (int) (dot - w->splitname), w->splitname,
+		(unsigned int) rd->id, dot);
+	ml->failed = 1;
+	if (len >= (int) sizeof(name))
+		return NULL;
+	ml->buf = (char *) malloc((size_t) w->flush_every * WRITER_LINE_MAX);
+	if (ml->buf == NULL)
+		return NULL;
+	ml->fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (ml->fd < 0) {
+		perror(name);
+		free(ml->buf);
+		ml->buf = NULL;
+		return NULL;
+	}
+	ml->failed = 0;
+	return ml;
+}
+
+static inline void *log_writer_thread(void *arg)
+{
+	struct log_writer *w = (struct log_writer *) arg;
+	char out[WRITER_RING_SIZE * WRITER_LINE_MAX];
+	struct stamp_cache stampcache;
+	const char *stamp;
+	struct log_reading *rd;
+	struct log_writer_meter *ml;
+	struct binlog_record rec;
+	char id[16];
+	char value[WRITER_LINE_MAX];
+	unsigned int tail;
+	size_t outlen;
+	int len;
+	int stop;
+
+	stamp_cache_init(&stampcache, 0);
+	for (;;) {
+		while (sem_wait(&w->wake) < 0 && errno == EINTR)
+			;
+		stop = __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE);
+
+		/* drain everything pushed so far into one batch */
+
+		outlen = 0;
+		tail = w->tail;
+		while (tail != __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+			/* the decode thread can keep refilling the ring while this runs */
+			if (outlen + WRITER_LINE_MAX > sizeof(out)) {
+				if (w->outfd >= 0)
+					log_writer_write(w->outfd, out, outlen);
+				outlen = 0;
+			}
+			rd = &w->ring[tail & (WRITER_RING_SIZE - 1)];
+			if (!rd->valid) {
+				len = snprintf(out + outlen, WRITER_LINE_MAX,
+					"Checksum Error.  Try running program using -a [1-3] to analyze sample data\n");
+				outlen += (len < WRITER_LINE_MAX) ? len : WRITER_LINE_MAX - 1;
+			} else {
+				if (stampcache.subsec != w->subsec)
+					stamp_cache_init(&stampcache, w->subsec);
+				stamp = stamp_format(&stampcache, rd->time, rd->nsec);
+				id[0] = '\0';
+				if (w->tag)
+					snprintf(id, sizeof(id), ",%08x", (unsigned int) rd->id);
+				if (w->integer)
+					snprintf(value, sizeof(value), "%lld%s", (long long) rd->milliwatts,
+						rd->corrected ? ",corrected" : "");
+				else
+					snprintf(value, sizeof(value), "%f%s", rd->watts, rd->corrected ? ",corrected" : "");
+				len = snprintf(out + outlen, WRITER_LINE_MAX, "%s%s,%s\n", stamp, id, value);
+				if (w->sockfd >= 0 && send(w->sockfd, out + outlen, (len < WRITER_LINE_MAX) ? len : WRITER_LINE_MAX - 1,
+						MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+					w->unsent++;
+				outlen += (len < WRITER_LINE_MAX) ? len : WRITER_LINE_MAX - 1;
+				if (w->logfd >= 0) {
+					len = snprintf(w->logbuf + w->loglen, WRITER_LINE_MAX, "%s%s,%s%s",
+						stamp, id, value, w->crlf ? "\r\n" : "\n");
+					w->loglen += (len < WRITER_LINE_MAX) ? len : WRITER_LINE_MAX - 1;
+				}
+				if (w->meterlogs != NULL && (ml = log_writer_meter(w, rd)) != NULL) {
+					len = snprintf(ml->buf + ml->len, WRITER_LINE_MAX, "%s%s,%s%s",
+						stamp, id, value, w->crlf ? "\r\n" : "\n");
+					ml->len += (len < WRITER_LINE_MAX) ? len : WRITER_LINE_MAX - 1;
+				}
+				if (w->binfd >= 0) {
+					rec.time = (uint32_t) rd->time;
+					rec.id = rd->id;
+					rec.adc = rd->adc;
+					rec.exponent = rd->exponent;
+					rec.flags = BINLOG_FLAG_CHECKSUM_OK | (rd->corrected ? BINLOG_FLAG_CORRECTED : 0);
+					rec.watts = w->integer ? (float) rd->milliwatts / 1000 : (float) rd->watts;
+					binlog_block_add(w->binbuf, &rec);
+				}
+				w->logcount++;
+				if (w->logcount == w->flush_every)
+					log_writer_flush(w);
+			}
+			tail++;
+			__atomic_store_n(&w->tail, tail, __ATOMIC_RELEASE);
+		}
+		if (w->outfd >= 0)
+			log_writer_write(w->outfd, out, outlen);
+
+		if (__atomic_load_n(&w->busy, __ATOMIC_ACQUIRE)) {
+			w->job(w->job_arg);
+			__atomic_store_n(&w->busy, 0, __ATOMIC_RELEASE);
+		}
+		if (stop)
+			break;
+	}
+
+	log_writer_flush(w);
+	return NULL;
+}
+
+// Start the writer thread.  logfd and binfd may be -1 to leave out the CSV or binary log.
+// Returns -1 on error.
+static inline int log_writer_open(struct log_writer *w, int logfd, int binfd, int flush_every, int crlf)
+{
+	w->head = 0;
+	w->tail = 0;
+	w->dropped = 0;
+	w->unsent = 0;
+	w->stop = 0;
+	w->busy = 0;
+	w->wait = 0;
+	w->tag = 0;
+	w->subsec = 0;
+	w->integer = 0;
+	w->splitname = NULL;
+	w->meterlogs = NULL;
+	w->outfd = STDOUT_FILENO;
+	w->sockfd = -1;
+	w->logfd = logfd;
+	w->crlf = crlf;
+	w->binfd = binfd;
+	w->flush_every = (flush_every > 0) ? flush_every : 1;
+	if (w->flush_every > BINLOG_BLOCK_MAX)
+		w->flush_every = BINLOG_BLOCK_MAX;
+	w->logcount = 0;
+	w->loglen = 0;
+	w->logbuf = (char *) malloc((size_t) w->flush_every * WRITER_LINE_MAX);
+	w->binbuf = (struct binlog_block *) calloc(1, sizeof(struct binlog_block));
+	if (w->logbuf == NULL || w->binbuf == NULL || sem_init(&w->wake, 0, 0) < 0) {
+		free(w->logbuf);
+		free(w->binbuf);
+		return -1;
+	}
+	/* anything printed with stdio so far has to come out before the writer's lines */
+	fflush(stdout);
+	if (pthread_create(&w->thread, NULL, log_writer_thread, w) != 0) {
+		sem_destroy(&w->wake);
+		free(w->logbuf);
+		free(w->binbuf);
+		return -1;
+	}
+	return 0;
+}
+
+// Write every transmitter's readings to a log of its own, named after name (see
+// log_writer_meter()), instead of the shared log.  Returns -1 if out of memory.
+static inline int log_writer_split(struct log_writer *w, const char *name)
+{
+	int i;
+
+	w->meterlogs = (struct log_writer_meter *) calloc(METER_MAX, sizeof(struct log_writer_meter));
+	if (w->meterlogs == NULL)
+		return -1;
+	for (i = 0; i < METER_MAX; i++)
+		w->meterlogs[i].fd = -1;
+	w->splitname = name;
+	return 0;
+}
+
+// Datagram socket for writer.sockfd, connected to host:port (e.g. "collector:5140" or
+// "[::1]:5140").  Returns -1, after reporting why, if it can't be set up.
+static inline int log_socket_open(const char *hostport)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256];
+	const char *port;
+	size_t len;
+	int fd = -1;
+	int err;
+
+	port = strrchr(hostport, ':');
+	if (port == NULL || port == hostport || port[1] == '\0') {
+		fprintf(stderr, "Expected host:port, not %s\n", hostport);
+		return -1;
+	}
+	len = port - hostport;
+	if (hostport[0] == '[' && len > 2 && hostport[len - 1] == ']') {
+		hostport++;
+		len -= 2;
+	}
+	if (len >= sizeof(host)) {
+		fprintf(stderr, "Host name too long: %s\n", hostport);
+		return -1;
+	}
+	memcpy(host, hostport, len);
+	host[len] = '\0';
+	port++;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	err = getaddrinfo(host, port, &hints, &res);
+	if (err != 0) {
+		fprintf(stderr, "%s: %s\n", hostport, gai_strerror(err));
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		perror(hostport);
+	return fd;
+}
+
+// Queue a reading from the decode thread.  Never blocks unless w->wait is set.  Returns 0
+// if the ring was full.
+static inline int log_writer_push(struct log_writer *w, const struct log_reading *reading)
+{
+	unsigned int head = w->head;
+	struct log_reading *rd;
+
+	while (head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= WRITER_RING_SIZE) {
+		if (!w->wait) {
+			w->dropped++;
+			return 0;
+		}
+		sched_yield();
+	}
+	rd = &w->ring[head & (WRITER_RING_SIZE - 1)];
+	*rd = *reading;
+	__atomic_store_n(&w->head, head + 1, __ATOMIC_RELEASE);
+	sem_post(&w->wake);
+	return 1;
+}
+
+// The last job handed to log_writer_job() has finished
+static inline int log_writer_idle(struct log_writer *w)
+{
+	return !__atomic_load_n(&w->busy, __ATOMIC_ACQUIRE);
+}
+
+// Have the writer thread run job(arg), from the decode thread.  Returns 0 if the last job
+// hasn't finished yet.  Anything job reads must be left alone until log_writer_idle().
+static inline int log_writer_job(struct log_writer *w, void (*job)(void *arg), void *arg)
+{
+	if (__atomic_load_n(&w->busy, __ATOMIC_ACQUIRE))
+		return 0;
+	w->job = job;
+	w->job_arg = arg;
+	__atomic_store_n(&w->busy, 1, __ATOMIC_RELEASE);
+	sem_post(&w->wake);
+	return 1;
+}
+
+// Wait until the writer thread has taken every reading pushed so far
+static inline void log_writer_drain(struct log_writer *w)
+{
+	while (__atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) != w->head)
+		sched_yield();
+}
+
+// Write out everything still queued, stop the thread and close the log files
+static inline void log_writer_close(struct log_writer *w)
+{
+	int i;
+
+	__atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&w->wake);
+	pthread_join(w->thread, NULL);
+	sem_destroy(&w->wake);
+	if (w->logfd >= 0)
+		close(w->logfd);
+	if (w->binfd >= 0)
+		close(w->binfd);
+	if (w->sockfd >= 0)
+		close(w->sockfd);
+	for (i = 0; w->meterlogs != NULL && i < METER_MAX; i++) {
+		if (w->meterlogs[i].fd >= 0)
+			close(w->meterlogs[i].fd);
+		free(w->meterlogs[i].buf);
+	}
+	free(w->meterlogs);
+	w->meterlogs = NULL;
+	free(w->logbuf);
+	free(w->binbuf);
+	w->logbuf = NULL;
+	w->binbuf = NULL;
+}
+
+#endif /* EFERGY_WRITER_H */
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Decode yield at lower rtl_fm sample rates, measured on captures recorded at -r 96000.
+# Each capture is averaged down to the rate with -D and decoded with the thresholds
+# scaled to it.  Extra EfergyRPI_log options go in OPTS, e.g. OPTS="-d elite".  The speed
+# includes the averaging, so it understates what a lower rate saves on a live stream.
+#
+#	./ratebench.sh monday.raw tuesday.raw
+args=""
+for f in "$@"; do args="$args -r $f"; done
+printf "%8s %10s %8s %8s\n" rate realtime frames errors
+for rate in 96000 48000 32000 24000; do
+	./EfergyRPI_log $OPTS -D $rate $args 2>&1 >/dev/null | awk -v rate=$rate '
+		/^Replayed/ { speed = substr($13, 2) }
+		/^Frames decoded:/ { frames = $3; errors = $6 }
+		END { printf "%8d %9dx %8d %8d\n", rate, speed, frames, errors }' | tr -d ,
+done